@@ -4,10 +4,38 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <deque>
 #include <algorithm>
 #include <iomanip>
 #include <sstream>
 #include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <cstdlib>
+#include <cerrno>
+#include <memory>
+#include <unordered_map>
+#include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <list>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define BOOKSTORE_HAVE_IO_URING 1
+#endif
+#ifdef BOOKSTORE_BENCH
+#include <chrono>
+#include <random>
+#include <thread>
+#include <dirent.h>
+#endif
 
 using namespace std;
 
@@ -50,198 +78,3967 @@ struct Book {
 struct Transaction {
     double amount;
     bool isIncome; // true for income (buy), false for expenditure (import)
+    int64_t timestamp; // Unix seconds
 };
 
-// Global data structures
-map<string, Account> accounts;
-map<string, Book> books;
-vector<Transaction> transactions;
-vector<pair<string, string>> operationLog; // (userID, operation)
+// ==================== Paged storage ====================
+//
+// Every data file is an array of fixed-size pages. Pages are only accessed
+// through the shared buffer pool, which keeps at most a fixed number of them
+// in memory and writes dirty pages back at checkpoints, through the page
+// journal, or when it has to evict them.
+
+const uint32_t PAGE_SIZE = 4096;
+const size_t DEFAULT_POOL_BYTES = 8 << 20;
+const size_t POOL_PARTITIONS = 8;
+const size_t POOL_PARTITION_MIN_FRAMES = 64;
+
+// Stored in the first byte of tree pages
+enum PageType : uint8_t {
+    PAGE_FREE = 0,
+    PAGE_META = 1,
+    PAGE_LEAF = 2,
+    PAGE_INTERNAL = 3
+};
+
+// Page 0 of every store file starts with a format stamp, so files of another
+// layout (or version) are refused instead of being read as garbage
+const char STORE_MAGIC[8] = "BKSTORE";
+const uint32_t STORE_FORMAT_VERSION = 2;
+
+enum FileKind : uint32_t {
+    FILE_ARRAY = 1,
+    FILE_TREE = 2,
+    FILE_LEDGER = 3,
+    FILE_BLOOM = 4,
+    FILE_JOURNAL = 5
+};
+
+struct FileFormat {
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;
+};
+
+// True if the file at path starts with a store format stamp
+bool hasStoreFormat(const string& path) {
+    FileFormat format;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool stamped = pread(fd, &format, sizeof(format), 0) == (ssize_t)sizeof(format) &&
+                   memcmp(format.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) == 0;
+    ::close(fd);
+    return stamped;
+}
+
+// ==================== Storage I/O ====================
+//
+// Page writes are copied into a fixed set of staging slots and handed to an
+// I/O backend in batches, so evicting or flushing a page never waits on the
+// disk and many writes share one system call. A page whose write is still
+// staged is read back from its slot.
+
+const size_t IO_SLOTS = 128;
+const size_t IO_BATCH = 32;
+const uint64_t IO_SYNC_TAG = ~0ull;
+
+enum IoOp : uint8_t {
+    IO_WRITE,
+    IO_FSYNC
+};
+
+struct IoRequest {
+    IoOp op;
+    int fd;
+    const char* data;
+    uint64_t offset;
+    uint64_t tag;
+};
+
+struct IoCompletion {
+    uint64_t tag;
+    int result;
+};
+
+// Executes batches of page writes and fsyncs. A request's buffer must stay
+// untouched until its completion is reaped; an fsync starts only after every
+// request submitted before it has finished.
+class IoBackend {
+public:
+    virtual ~IoBackend() {}
+    virtual const char* name() const = 0;
+    virtual void submit(const vector<IoRequest>& batch) = 0;
+    // Appends finished requests; with wait, blocks until at least one finishes
+    virtual void reap(vector<IoCompletion>& done, bool wait) = 0;
+};
+
+// Portable fallback: performs each batch with pwrite/fsync when submitted
+class SyncIoBackend : public IoBackend {
+public:
+    const char* name() const override { return "pwrite"; }
+
+    void submit(const vector<IoRequest>& batch) override {
+        for (const auto& req : batch) {
+            int result;
+            if (req.op == IO_WRITE) {
+                ssize_t n = pwrite(req.fd, req.data, PAGE_SIZE, (off_t)req.offset);
+                result = n < 0 ? -errno : (int)n;
+            } else {
+                result = fsync(req.fd) == 0 ? 0 : -errno;
+            }
+            finished.push_back({req.tag, result});
+        }
+    }
+
+    void reap(vector<IoCompletion>& done, bool) override {
+        done.insert(done.end(), finished.begin(), finished.end());
+        finished.clear();
+    }
+
+private:
+    vector<IoCompletion> finished;
+};
+
+#ifdef BOOKSTORE_HAVE_IO_URING
+// io_uring driven through the raw system calls; each batch is one
+// io_uring_enter and completions are read straight from the mapped ring
+class UringIoBackend : public IoBackend {
+public:
+    UringIoBackend() : ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED) {}
+
+    ~UringIoBackend() override {
+        if (sqes != MAP_FAILED) munmap(sqes, sqeBytes);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqBytes);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqBytes);
+        if (ringFd >= 0) ::close(ringFd);
+    }
+
+    bool open(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ringFd < 0) return false;
+
+        sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) sqBytes = cqBytes = max(sqBytes, cqBytes);
+
+        sqRing = mmap(nullptr, sqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                      IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return false;
+        cqRing = singleMap ? sqRing
+                           : mmap(nullptr, cqBytes, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+        sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                    IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+
+        char* sq = static_cast<char*>(sqRing);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return supportsOps();
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    void submit(const vector<IoRequest>& batch) override {
+        for (size_t start = 0; start < batch.size(); start += sqEntries) {
+            size_t count = min<size_t>(sqEntries, batch.size() - start);
+            unsigned tail = *sqTail;
+            for (size_t i = start; i < start + count; i++) {
+                const IoRequest& req = batch[i];
+                unsigned index = tail & sqMask;
+                io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes) + index;
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->fd = req.fd;
+                sqe->user_data = req.tag;
+                if (req.op == IO_WRITE) {
+                    sqe->opcode = IORING_OP_WRITE;
+                    sqe->addr = (uint64_t)(uintptr_t)req.data;
+                    sqe->len = PAGE_SIZE;
+                    sqe->off = req.offset;
+                } else {
+                    sqe->opcode = IORING_OP_FSYNC;
+                    sqe->flags = IOSQE_IO_DRAIN;
+                }
+                sqArray[index] = index;
+                tail++;
+            }
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+            enter((unsigned)count, 0, 0);
+        }
+    }
+
+    void reap(vector<IoCompletion>& done, bool wait) override {
+        while (true) {
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                const io_uring_cqe& cqe = cqes[head & cqMask];
+                done.push_back({cqe.user_data, cqe.res});
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            if (!done.empty() || !wait) return;
+            enter(0, 1, IORING_ENTER_GETEVENTS);
+        }
+    }
+
+private:
+    int ringFd;
+    void* sqRing;
+    void* cqRing;
+    void* sqes;
+    size_t sqBytes = 0;
+    size_t cqBytes = 0;
+    size_t sqeBytes = 0;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    // True if the kernel implements every opcode issued here. Kernels 5.1 to
+    // 5.5 set up rings but reject IORING_OP_WRITE, and they also lack the
+    // probe, so a failed probe counts as unsupported.
+    bool supportsOps() {
+        const unsigned probeOps = 256;
+        vector<char> buf(sizeof(io_uring_probe) + probeOps * sizeof(io_uring_probe_op));
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, probeOps) < 0) {
+            return false;
+        }
+        for (int op : {IORING_OP_WRITE, IORING_OP_FSYNC}) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        }
+        return true;
+    }
+
+    void enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        while (toSubmit > 0 || minComplete > 0) {
+            long n = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("io_uring_enter failed");
+            }
+            toSubmit -= (unsigned)n;
+            minComplete = 0;
+        }
+    }
+};
+#endif
+
+// Backend chosen by BOOKSTORE_IO ("uring" or "pwrite"); io_uring is used
+// whenever the kernel allows it
+unique_ptr<IoBackend> makeIoBackend() {
+    const char* env = getenv("BOOKSTORE_IO");
+    bool forceSync = env != nullptr && strcmp(env, "pwrite") == 0;
+#ifdef BOOKSTORE_HAVE_IO_URING
+    if (!forceSync) {
+        unique_ptr<UringIoBackend> uring(new UringIoBackend());
+        if (uring->open(2 * IO_SLOTS)) return uring;
+    }
+#endif
+    (void)forceSync;
+    return unique_ptr<IoBackend>(new SyncIoBackend());
+}
+
+struct IoStats {
+    uint64_t writes = 0;
+    uint64_t coalesced = 0;
+    uint64_t fsyncs = 0;
+    uint64_t submissions = 0;
+    uint64_t stalls = 0;
+};
+
+// Staging slots in front of the backend; safe to use from several threads
+class StorageIo {
+public:
+    StorageIo() : backend(makeIoBackend()), slots(IO_SLOTS), buffers(IO_SLOTS * PAGE_SIZE), inFlight(0) {
+        for (size_t i = IO_SLOTS; i > 0; i--) freeSlots.push_back(i - 1);
+    }
+
+    ~StorageIo() { drain(); }
+
+    void writePage(int fd, uint32_t pageNo, const char* data) {
+        lock_guard<mutex> guard(latch);
+        uint64_t key = slotKey(fd, pageNo);
+        auto it = staged.find(key);
+        if (it != staged.end()) {
+            size_t slot = it->second;
+            if (slots[slot].state == SLOT_QUEUED) {
+                // Not submitted yet: the newer image simply replaces it
+                memcpy(buffer(slot), data, PAGE_SIZE);
+                stats.coalesced++;
+                return;
+            }
+            // Let the older write land first so the two cannot reorder
+            while (slots[slot].state != SLOT_FREE) collect(true);
+        }
+
+        size_t slot = takeSlot();
+        memcpy(buffer(slot), data, PAGE_SIZE);
+        slots[slot].state = SLOT_QUEUED;
+        slots[slot].key = key;
+        staged[key] = slot;
+        pending.push_back({IO_WRITE, fd, buffer(slot), (uint64_t)pageNo * PAGE_SIZE, slot});
+        stats.writes++;
+        if (pending.size() >= IO_BATCH) submitPending();
+    }
+
+    // Copies the staged image of a page; false if none is staged
+    bool readStaged(int fd, uint32_t pageNo, char* buf) {
+        lock_guard<mutex> guard(latch);
+        auto it = staged.find(slotKey(fd, pageNo));
+        if (it == staged.end()) return false;
+        memcpy(buf, buffer(it->second), PAGE_SIZE);
+        return true;
+    }
+
+    // Queues an fsync ordered after every write queued so far
+    void sync(int fd) {
+        lock_guard<mutex> guard(latch);
+        pending.push_back({IO_FSYNC, fd, nullptr, 0, IO_SYNC_TAG});
+        stats.fsyncs++;
+    }
+
+    // Submits queued requests and collects finished ones without blocking
+    void poll() {
+        lock_guard<mutex> guard(latch);
+        submitPending();
+        collect(false);
+    }
+
+    // Blocks until every queued request has completed
+    void drain() {
+        lock_guard<mutex> guard(latch);
+        submitPending();
+        while (inFlight > 0) collect(true);
+    }
+
+    const char* backendName() const { return backend->name(); }
+    const IoStats& statistics() const { return stats; }
+
+private:
+    enum SlotState : uint8_t {
+        SLOT_FREE,
+        SLOT_QUEUED,
+        SLOT_IN_FLIGHT
+    };
+
+    struct Slot {
+        SlotState state = SLOT_FREE;
+        uint64_t key = 0;
+    };
+
+    mutex latch;
+    unique_ptr<IoBackend> backend;
+    vector<Slot> slots;
+    vector<char> buffers;
+    vector<size_t> freeSlots;
+    unordered_map<uint64_t, size_t> staged;
+    vector<IoRequest> pending;
+    size_t inFlight;
+    IoStats stats;
+
+    static uint64_t slotKey(int fd, uint32_t pageNo) { return ((uint64_t)fd << 32) | pageNo; }
+
+    char* buffer(size_t slot) { return &buffers[slot * PAGE_SIZE]; }
+
+    size_t takeSlot() {
+        if (freeSlots.empty()) {
+            submitPending();
+            collect(false);
+        }
+        while (freeSlots.empty()) {
+            stats.stalls++;
+            collect(true);
+        }
+        size_t slot = freeSlots.back();
+        freeSlots.pop_back();
+        return slot;
+    }
+
+    void submitPending() {
+        if (pending.empty()) return;
+        for (const auto& req : pending) {
+            if (req.op == IO_WRITE) slots[req.tag].state = SLOT_IN_FLIGHT;
+        }
+        backend->submit(pending);
+        inFlight += pending.size();
+        stats.submissions++;
+        pending.clear();
+    }
+
+    // Redoes a write the backend failed or cut short with a plain pwrite,
+    // before its slot can be reused
+    void rewrite(size_t slot) {
+        int fd = (int)(slots[slot].key >> 32);
+        off_t offset = (off_t)(uint32_t)slots[slot].key * PAGE_SIZE;
+        if (pwrite(fd, buffer(slot), PAGE_SIZE, offset) != (ssize_t)PAGE_SIZE) {
+            throw runtime_error("page write failed");
+        }
+    }
+
+    void collect(bool wait) {
+        if (inFlight == 0) return;
+        vector<IoCompletion> done;
+        backend->reap(done, wait);
+        for (const auto& c : done) {
+            inFlight--;
+            if (c.tag == IO_SYNC_TAG) {
+                if (c.result < 0) throw runtime_error("fsync failed");
+                continue;
+            }
+            Slot& s = slots[c.tag];
+            if (c.result != (int)PAGE_SIZE) rewrite(c.tag);
+            staged.erase(s.key);
+            s.state = SLOT_FREE;
+            freeSlots.push_back(c.tag);
+        }
+    }
+};
+
+StorageIo storageIo;
+
+class PagedFile {
+public:
+    PagedFile() : fd(-1), pages(0), shrunk(false), shrinkLogged(false) {}
+    ~PagedFile() { close(); }
+
+    bool open(const string& path) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+        struct stat st;
+        fstat(fd, &st);
+        pages = (st.st_size + PAGE_SIZE - 1) / PAGE_SIZE;
+        name = path;
+        return true;
+    }
+
+    const string& path() const { return name; }
+
+    void close() {
+        if (fd >= 0) {
+            storageIo.drain();
+            ::close(fd);
+        }
+        fd = -1;
+    }
+
+    uint32_t pageCount() const { return pages; }
+
+    // Lets the kernel read ahead in large blocks while a scan walks the
+    // file front to back
+    void adviseSequential(bool sequential) {
+        posix_fadvise(fd, 0, 0, sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+    }
+    uint32_t allocatePage() { return pages++; }
+
+    // The file itself is only cut once the pool writes everything back, so
+    // a crash cannot leave it shorter than the pages on disk expect
+    void truncate(uint32_t pageCount) {
+        pages = pageCount;
+        shrunk = true;
+        shrinkLogged = false;
+    }
+
+    bool truncatePending() const { return shrunk; }
+    bool truncationUnlogged() const { return shrunk && !shrinkLogged; }
+    void noteTruncationLogged() { shrinkLogged = true; }
+
+    // Cuts the file to its page count; called once staged writes have landed
+    void applyTruncate() {
+        if (ftruncate(fd, (off_t)pages * PAGE_SIZE) != 0) throw runtime_error("cannot truncate " + name);
+        shrunk = false;
+    }
+
+    // Pages past the end of the file read as zeros
+    void readPage(uint32_t pageNo, char* buf) {
+        if (pageNo >= pages) {
+            memset(buf, 0, PAGE_SIZE);
+            return;
+        }
+        if (storageIo.readStaged(fd, pageNo, buf)) return;
+        ssize_t n = pread(fd, buf, PAGE_SIZE, (off_t)pageNo * PAGE_SIZE);
+        if (n < 0) n = 0;
+        if (n < (ssize_t)PAGE_SIZE) memset(buf + n, 0, PAGE_SIZE - n);
+    }
+
+    // Returns once the page is staged; the write itself completes later
+    void writePage(uint32_t pageNo, const char* buf) { storageIo.writePage(fd, pageNo, buf); }
+
+    void sync() { storageIo.sync(fd); }
+
+private:
+    int fd;
+    uint32_t pages;
+    bool shrunk;
+    bool shrinkLogged;
+    string name;
+};
+
+// ==================== Page journal ====================
+//
+// A redo log that makes every checkpoint atomic against a crash of the
+// process. A checkpoint appends the pages changed since the previous one,
+// and the new length of every truncated file, to the journal as one
+// checksummed batch. A page is logged whole, or only the byte range that
+// changed if the pool still has a copy of its last logged image. The pages
+// stay in the pool and reach their files when evicted, or all at once when
+// the journal outgrows JOURNAL_LIMIT_BYTES. The journal is then emptied by
+// advancing its epoch, and the next batches overwrite the old ones in place.
+// Startup replays the complete batches of the current epoch in order, up to
+// the first torn one, so the store always reflects some checkpoint.
+//
+// Batches are group-committed: they fill journal pages that go out through
+// storageIo like any other page write, and nothing waits for them until a
+// page they cover is written back, a page is stolen, or the main loop runs
+// out of input. The main loop checkpoints after every command, so a command
+// is durable once its output has been flushed; a crash in the middle of a
+// batch-mode run can lose the commands since the last full journal page,
+// but replay never applies a later batch without the earlier ones.
+//
+// A page changed since the last checkpoint that has to be evicted ("stolen")
+// reaches its file outside the journal. That only happens when one command
+// changes more pages than the pool holds, e.g. an index rebuild. The journal
+// header then records the steal until the next checkpoint has written every
+// page back; if the process dies before that, startup rebuilds the secondary
+// indexes and filters from the catalog. Nothing is fsynced before shutdown:
+// the journal guards against the process dying, not against power loss.
+
+const uint32_t JOURNAL_NAME_BYTES = 40;
+const uint64_t JOURNAL_LIMIT_BYTES = 4 << 20;
+const size_t JOURNAL_SHADOW_PAGES = 64;
+
+struct JournalHeader {
+    FileFormat format;
+    uint32_t stolen;
+    uint32_t reserved;
+    uint64_t epoch;  // batches of earlier epochs are stale
+};
+
+// Precedes the entries of one checkpoint
+struct JournalBatch {
+    uint64_t epoch;
+    uint64_t bytes;
+    uint32_t entries;
+    uint32_t reserved;
+    uint64_t checksum;
+};
+
+// Followed by length bytes of the page starting at offset; a truncation
+// has length 0
+struct JournalEntry {
+    char file[JOURNAL_NAME_BYTES];
+    uint32_t pageNo;  // new page count for a truncation
+    uint16_t offset;
+    uint16_t length;
+};
+
+class PageJournal {
+public:
+    PageJournal() : tail(PAGE_SIZE) {}
+
+    ~PageJournal() {
+        if (fd >= 0) {
+            storageIo.drain();
+            ::close(fd);
+        }
+    }
+
+    // Opens (or creates) the journal and replays its complete batches into
+    // the files. Returns true if the previous process died with stolen pages
+    // on disk; the steal stays recorded until the next full write-back.
+    bool open(const string& path) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) throw runtime_error("cannot open " + path);
+        JournalHeader header;
+        ssize_t n = pread(fd, &header, sizeof(header), 0);
+        if (n == 0) {
+            writeHeader(false, 1);
+            return false;
+        }
+        if (n != (ssize_t)sizeof(header) || memcmp(header.format.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0 ||
+            header.format.version != STORE_FORMAT_VERSION || header.format.kind != FILE_JOURNAL) {
+            throw runtime_error(path + ": not a store file of this format");
+        }
+        stolen = header.stolen != 0;
+        epoch = header.epoch;
+        replay();
+        return stolen;
+    }
+
+    // Records that a changed page is about to be written outside a batch
+    void noteSteal() {
+        lock_guard<mutex> guard(latch);
+        if (fd < 0 || stolen) return;
+        writeHeader(true, epoch);
+        storageIo.drain();
+    }
+
+    bool stealRecorded() const { return stolen; }
+    bool full() const { return end >= PAGE_SIZE + JOURNAL_LIMIT_BYTES; }
+
+    // Starts a batch; returns its sequence number
+    uint64_t begin() {
+        batch.assign(sizeof(JournalBatch), '\0');
+        entries = 0;
+        return sequence + 1;
+    }
+
+    // Logs length bytes of the page, starting at offset
+    void addPage(const string& file, uint32_t pageNo, uint32_t offset, uint32_t length, const char* data) {
+        addEntry(file, pageNo, offset, length);
+        batch.append(data, length);
+    }
+
+    void addTruncation(const string& file, uint32_t pageCount) { addEntry(file, pageCount, 0, 0); }
+
+    // Appends the batch; it survives a crash once hardened
+    void commit() {
+        lock_guard<mutex> guard(latch);
+        if (fd < 0) return;
+        JournalBatch* header = reinterpret_cast<JournalBatch*>(&batch[0]);
+        header->epoch = epoch;
+        header->bytes = batch.size() - sizeof(JournalBatch);
+        header->entries = entries;
+        header->checksum = checksum(*header, batch.data() + sizeof(JournalBatch));
+        append(batch.data(), batch.size());
+        sequence++;
+    }
+
+    // Waits until every batch up to seq has reached the journal file
+    void harden(uint64_t seq) {
+        lock_guard<mutex> guard(latch);
+        if (fd < 0 || min(seq, sequence) <= hardened) return;
+        if (end % PAGE_SIZE != 0) storageIo.writePage(fd, end / PAGE_SIZE, tail.data());
+        storageIo.drain();
+        hardened = sequence;
+    }
+
+    // Hardens every batch committed so far
+    void flush() { harden(UINT64_MAX); }
+
+    // Empties the journal once every page it holds has reached its file
+    void clear() {
+        lock_guard<mutex> guard(latch);
+        if (fd < 0 || (end == PAGE_SIZE && !stolen)) return;
+        writeHeader(false, epoch + 1);
+        end = PAGE_SIZE;
+        memset(tail.data(), 0, PAGE_SIZE);
+    }
+
+private:
+    int fd = -1;
+    bool stolen = false;
+    uint64_t epoch = 0;
+    uint64_t end = PAGE_SIZE;
+    uint64_t sequence = 0;  // batches committed
+    uint64_t hardened = 0;  // batches known to be in the file
+    vector<char> tail;      // the page end falls in
+    mutex latch;
+    string batch;
+    uint32_t entries = 0;
+
+    // Four independent lanes over 8-byte words, so the multiplies overlap
+    static uint64_t checksum(const JournalBatch& header, const char* data) {
+        uint64_t lanes[4] = {header.epoch, header.bytes, header.entries, 0x9e3779b97f4a7c15ull};
+        uint64_t words[4];
+        size_t i = 0;
+        for (; i + sizeof(words) <= header.bytes; i += sizeof(words)) {
+            memcpy(words, data + i, sizeof(words));
+            for (int k = 0; k < 4; k++) lanes[k] = (lanes[k] ^ words[k]) * 0x100000001b3ull;
+        }
+        for (; i < header.bytes; i++) lanes[0] = (lanes[0] ^ (unsigned char)data[i]) * 0x100000001b3ull;
+        uint64_t hash = 0;
+        for (int k = 0; k < 4; k++) hash = (hash ^ lanes[k] ^ lanes[k] >> 29) * 0x9e3779b97f4a7c15ull;
+        return hash;
+    }
+
+    void addEntry(const string& file, uint32_t pageNo, uint32_t offset, uint32_t length) {
+        if (file.size() >= JOURNAL_NAME_BYTES) throw runtime_error("journal: file name too long: " + file);
+        JournalEntry e;
+        memset(&e, 0, sizeof(e));
+        memcpy(e.file, file.data(), file.size());
+        e.pageNo = pageNo;
+        e.offset = offset;
+        e.length = length;
+        batch.append(reinterpret_cast<const char*>(&e), sizeof(e));
+        entries++;
+    }
+
+    // Copies data into the tail page, staging each page as it fills
+    void append(const char* data, size_t size) {
+        while (size > 0) {
+            size_t at = end % PAGE_SIZE;
+            size_t n = min(size, (size_t)PAGE_SIZE - at);
+            memcpy(&tail[at], data, n);
+            data += n;
+            size -= n;
+            end += n;
+            if (end % PAGE_SIZE == 0) {
+                storageIo.writePage(fd, end / PAGE_SIZE - 1, tail.data());
+                memset(tail.data(), 0, PAGE_SIZE);
+            }
+        }
+    }
+
+    void writeHeader(bool steal, uint64_t newEpoch) {
+        vector<char> page(PAGE_SIZE, 0);
+        JournalHeader* header = reinterpret_cast<JournalHeader*>(page.data());
+        memcpy(header->format.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+        header->format.version = STORE_FORMAT_VERSION;
+        header->format.kind = FILE_JOURNAL;
+        header->stolen = steal;
+        header->epoch = newEpoch;
+        storageIo.writePage(fd, 0, page.data());
+        stolen = steal;
+        epoch = newEpoch;
+    }
+
+    // Applies the batches of the current epoch up to the first torn one (the
+    // checkpoint the process died in), then empties the journal; a steal
+    // stays recorded
+    void replay() {
+        map<string, int> files;
+        struct stat st;
+        fstat(fd, &st);
+        uint64_t offset = PAGE_SIZE;
+        JournalBatch header;
+        string data;
+        while (pread(fd, &header, sizeof(header), offset) == (ssize_t)sizeof(header)) {
+            if (header.epoch != epoch || header.bytes > (uint64_t)st.st_size - offset - sizeof(header)) break;
+            data.resize(header.bytes);
+            if (pread(fd, &data[0], data.size(), offset + sizeof(header)) != (ssize_t)data.size() ||
+                checksum(header, data.data()) != header.checksum) {
+                break;
+            }
+            size_t pos = 0;
+            for (uint32_t i = 0; i < header.entries; i++) {
+                JournalEntry e;
+                memcpy(&e, data.data() + pos, sizeof(e));
+                pos += sizeof(e);
+                string name(e.file, strnlen(e.file, sizeof(e.file)));
+                if (files.count(name) == 0) {
+                    files[name] = ::open(name.c_str(), O_RDWR | O_CREAT, 0644);
+                    if (files[name] < 0) throw runtime_error("cannot open " + name);
+                }
+                bool done;
+                if (e.length == 0) {
+                    done = ftruncate(files[name], (off_t)e.pageNo * PAGE_SIZE) == 0;
+                } else {
+                    off_t at = (off_t)e.pageNo * PAGE_SIZE + e.offset;
+                    done = pwrite(files[name], data.data() + pos, e.length, at) == (ssize_t)e.length;
+                    pos += e.length;
+                }
+                if (!done) throw runtime_error("journal replay failed on " + name);
+            }
+            offset += sizeof(header) + header.bytes;
+        }
+        for (const auto& file : files) ::close(file.second);
+        writeHeader(stolen, epoch + 1);
+    }
+};
+
+PageJournal pageJournal;
+
+class BufferPool;
+
+// Pin on a buffer pool frame; the page stays resident while the ref lives
+class PageRef {
+public:
+    PageRef() : pool(nullptr), frame(0) {}
+    PageRef(BufferPool* pool, size_t frame) : pool(pool), frame(frame) {}
+    PageRef(PageRef&& other) : pool(other.pool), frame(other.frame) { other.pool = nullptr; }
+    PageRef& operator=(PageRef&& other) {
+        if (this != &other) {
+            release();
+            pool = other.pool;
+            frame = other.frame;
+            other.pool = nullptr;
+        }
+        return *this;
+    }
+    PageRef(const PageRef&) = delete;
+    PageRef& operator=(const PageRef&) = delete;
+    ~PageRef() { release(); }
+
+    bool valid() const { return pool != nullptr; }
+    uint32_t pageNo() const;
+    char* data() const;
+    template <class T> T* as() const { return reinterpret_cast<T*>(data()); }
+    void markDirty();
+    void release();
+
+private:
+    BufferPool* pool;
+    size_t frame;
+};
+
+struct PoolStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t writebacks = 0;
+};
+
+// Page cache shared by all data files, bounded by a byte budget.
+// Frames are split into partitions by page hash, each with its own latch,
+// page table and clock hand, so threads working on different pages rarely
+// contend. Victims are chosen with the clock algorithm among the unpinned
+// frames of the page's partition. A page's contents are protected by the
+// lock of the structure that owns it, not by the pool.
+class BufferPool {
+public:
+    explicit BufferPool(size_t budgetBytes)
+        : frameCount(max<size_t>(budgetBytes / PAGE_SIZE, 16)),
+          partitionCount(max<size_t>(1, min(POOL_PARTITIONS, frameCount / POOL_PARTITION_MIN_FRAMES))),
+          framesPerPartition(frameCount / partitionCount),
+          memory(frameCount * PAGE_SIZE),
+          frames(frameCount),
+          partitions(new Partition[partitionCount]),
+          shadowCount(min(JOURNAL_SHADOW_PAGES, frameCount / 4)),
+          shadows(shadowCount * PAGE_SIZE),
+          shadowOwners(shadowCount, frameCount),
+          shadowHand(0) {
+        for (size_t i = 0; i < partitionCount; i++) {
+            partitions[i].first = i * framesPerPartition;
+            partitions[i].count = i + 1 == partitionCount ? frameCount - partitions[i].first
+                                                          : framesPerPartition;
+            partitions[i].clockHand = partitions[i].first;
+        }
+    }
+
+    // Files are attached during startup, before any other thread runs
+    int attach(PagedFile* file) {
+        files.push_back(file);
+        return files.size() - 1;
+    }
+
+    PageRef fetch(int fileId, uint32_t pageNo) {
+        uint64_t key = pageKey(fileId, pageNo);
+        Partition& p = partitionOf(key);
+        lock_guard<mutex> guard(p.latch);
+        auto it = p.pageTable.find(key);
+        if (it != p.pageTable.end()) {
+            Frame& f = frames[it->second];
+            f.pinCount++;
+            f.referenced = true;
+            p.stats.hits++;
+            return PageRef(this, it->second);
+        }
+        p.stats.misses++;
+        size_t frame = acquireFrame(p, fileId, pageNo);
+        files[fileId]->readPage(pageNo, frameData(frame));
+        return PageRef(this, frame);
+    }
+
+    // Frame for a freshly allocated page; starts zeroed and dirty
+    PageRef create(int fileId, uint32_t pageNo) {
+        Partition& p = partitionOf(pageKey(fileId, pageNo));
+        lock_guard<mutex> guard(p.latch);
+        size_t frame = acquireFrame(p, fileId, pageNo);
+        memset(frameData(frame), 0, PAGE_SIZE);
+        markFrameDirty(p, frame);
+        return PageRef(this, frame);
+    }
+
+    // Drops cached pages at or past fromPage without writing them back; used
+    // when the file is truncated
+    void discard(int fileId, uint32_t fromPage) {
+        for (size_t i = 0; i < partitionCount; i++) {
+            Partition& p = partitions[i];
+            lock_guard<mutex> guard(p.latch);
+            for (size_t frame = p.first; frame < p.first + p.count; frame++) {
+                Frame& f = frames[frame];
+                if (f.fileId != fileId || f.pageNo < fromPage) continue;
+                p.pageTable.erase(pageKey(f.fileId, f.pageNo));
+                f.fileId = -1;
+                f.dirty = false;
+                f.changed = false;
+                f.referenced = false;
+                f.shadow = -1;
+            }
+        }
+    }
+
+    // Appends the pages changed since the last checkpoint, and pending
+    // truncations, to the journal as one batch. Everything is written back
+    // once the journal is full or a page was stolen. Called between commands,
+    // when no page is pinned.
+    void checkpoint() {
+        vector<size_t> changed;
+        for (size_t i = 0; i < partitionCount; i++) {
+            Partition& p = partitions[i];
+            lock_guard<mutex> guard(p.latch);
+            for (size_t frame : p.changedFrames) {
+                if (frames[frame].changed) changed.push_back(frame);
+                frames[frame].changed = false;
+            }
+            p.changedFrames.clear();
+            p.stealing = false;
+        }
+        sort(changed.begin(), changed.end());
+        changed.erase(unique(changed.begin(), changed.end()), changed.end());
+        bool truncated = false;
+        for (PagedFile* file : files) truncated = truncated || file->truncationUnlogged();
+
+        if (!changed.empty() || truncated) {
+            uint64_t batch = pageJournal.begin();
+            for (size_t frame : changed) logChanges(frame, batch);
+            for (PagedFile* file : files) {
+                if (file->truncationUnlogged()) {
+                    pageJournal.addTruncation(file->path(), file->pageCount());
+                    file->noteTruncationLogged();
+                }
+            }
+            pageJournal.commit();
+        }
+        if (pageJournal.full() || pageJournal.stealRecorded()) writeBackAll();
+    }
+
+    // Checkpoints and writes everything back, then fsyncs all files and
+    // waits for completion
+    void flushAll() {
+        checkpoint();
+        writeBackAll();
+        for (PagedFile* file : files) file->sync();
+        storageIo.drain();
+    }
+
+    size_t capacity() const { return frameCount * PAGE_SIZE; }
+    size_t frameTotal() const { return frameCount; }
+    size_t partitionTotal() const { return partitionCount; }
+
+    PoolStats statistics() {
+        PoolStats total;
+        for (size_t i = 0; i < partitionCount; i++) {
+            lock_guard<mutex> guard(partitions[i].latch);
+            const PoolStats& s = partitions[i].stats;
+            total.hits += s.hits;
+            total.misses += s.misses;
+            total.evictions += s.evictions;
+            total.writebacks += s.writebacks;
+        }
+        return total;
+    }
+
+private:
+    friend class PageRef;
+
+    struct Frame {
+        int fileId = -1;
+        uint32_t pageNo = 0;
+        int pinCount = 0;
+        bool dirty = false;    // differs from the file
+        bool changed = false;  // differs from the journal
+        bool referenced = false;
+        int shadow = -1;       // copy of the image last logged, if kept
+        uint64_t logged = 0;   // journal batch holding that image
+    };
+
+    struct Partition {
+        mutex latch;
+        size_t first = 0;
+        size_t count = 0;
+        size_t clockHand = 0;
+        unordered_map<uint64_t, size_t> pageTable;
+        vector<size_t> changedFrames;  // changed since the last checkpoint
+        bool stealing = false;         // a changed page was evicted since then
+        PoolStats stats;
+    };
+
+    size_t frameCount;
+    size_t partitionCount;
+    size_t framesPerPartition;
+    vector<char> memory;
+    vector<Frame> frames;
+    unique_ptr<Partition[]> partitions;
+    vector<PagedFile*> files;
+    size_t shadowCount;
+    vector<char> shadows;
+    vector<size_t> shadowOwners;
+    size_t shadowHand;
+
+    static uint64_t pageKey(int fileId, uint32_t pageNo) {
+        return ((uint64_t)fileId << 32) | pageNo;
+    }
+
+    Partition& partitionOf(uint64_t key) {
+        return partitions[(key * 0x9e3779b97f4a7c15ull >> 32) % partitionCount];
+    }
+
+    Partition& partitionOfFrame(size_t frame) {
+        return partitions[min(frame / framesPerPartition, partitionCount - 1)];
+    }
+
+    char* frameData(size_t frame) { return &memory[frame * PAGE_SIZE]; }
+
+    // Caller holds p.latch
+    void markFrameDirty(Partition& p, size_t frame) {
+        frames[frame].dirty = true;
+        if (frames[frame].changed) return;
+        frames[frame].changed = true;
+        if (p.changedFrames.size() >= 2 * p.count) {
+            // Mostly frames evicted since; keep the list bounded
+            p.changedFrames.clear();
+            for (size_t i = p.first; i < p.first + p.count; i++) {
+                if (frames[i].changed && i != frame) p.changedFrames.push_back(i);
+            }
+        }
+        p.changedFrames.push_back(frame);
+    }
+
+    // Logs the 64-byte blocks of a changed frame that differ from its
+    // shadow, or the whole page without one; the frame's image then becomes
+    // its shadow
+    void logChanges(size_t frame, uint64_t batch) {
+        Frame& f = frames[frame];
+        const char* data = frameData(frame);
+        const string& path = files[f.fileId]->path();
+        if (f.shadow >= 0) {
+            const char* shadow = shadowData(f.shadow);
+            uint32_t first = 0;
+            uint32_t last = PAGE_SIZE;
+            while (first < PAGE_SIZE && memcmp(data + first, shadow + first, 64) == 0) first += 64;
+            if (first == PAGE_SIZE) return;
+            while (memcmp(data + last - 64, shadow + last - 64, 64) == 0) last -= 64;
+            pageJournal.addPage(path, f.pageNo, first, last - first, data + first);
+        } else {
+            pageJournal.addPage(path, f.pageNo, 0, PAGE_SIZE, data);
+            f.shadow = takeShadow(frame);
+        }
+        memcpy(shadowData(f.shadow), data, PAGE_SIZE);
+        f.logged = batch;
+    }
+
+    // Shadows are handed out round-robin, taking the oldest from its frame
+    int takeShadow(size_t frame) {
+        int shadow = shadowHand;
+        shadowHand = (shadowHand + 1) % shadowCount;
+        size_t owner = shadowOwners[shadow];
+        if (owner < frameCount && frames[owner].shadow == shadow) frames[owner].shadow = -1;
+        shadowOwners[shadow] = frame;
+        return shadow;
+    }
+
+    char* shadowData(int shadow) { return &shadows[shadow * PAGE_SIZE]; }
+
+    // Writes every dirty page and pending truncation to the files, then
+    // empties the journal
+    void writeBackAll() {
+        for (size_t i = 0; i < partitionCount; i++) {
+            Partition& p = partitions[i];
+            lock_guard<mutex> guard(p.latch);
+            for (size_t frame = p.first; frame < p.first + p.count; frame++) {
+                if (frames[frame].dirty) writeBack(p, frame);
+            }
+        }
+        storageIo.drain();
+        for (PagedFile* file : files) {
+            if (file->truncatePending()) file->applyTruncate();
+        }
+        pageJournal.clear();
+    }
+
+    // Caller holds p.latch. Changed frames are passed over while another is
+    // left, since writing one back before the checkpoint is a steal.
+    size_t acquireFrame(Partition& p, int fileId, uint32_t pageNo) {
+        for (size_t scanned = 0; scanned < 3 * p.count; scanned++) {
+            size_t i = p.clockHand;
+            p.clockHand = p.clockHand + 1 == p.first + p.count ? p.first : p.clockHand + 1;
+            Frame& f = frames[i];
+            if (f.pinCount > 0) continue;
+            if (f.referenced) {
+                f.referenced = false;
+                continue;
+            }
+            if (f.changed && !p.stealing && scanned < 2 * p.count) continue;
+            if (f.fileId >= 0) {
+                if (f.changed) {
+                    p.stealing = true;
+                    pageJournal.noteSteal();
+                }
+                if (f.dirty) writeBack(p, i);
+                p.pageTable.erase(pageKey(f.fileId, f.pageNo));
+                p.stats.evictions++;
+            }
+            f.fileId = fileId;
+            f.pageNo = pageNo;
+            f.pinCount = 1;
+            f.referenced = true;
+            f.dirty = false;
+            f.changed = false;
+            f.shadow = -1;
+            f.logged = 0;
+            p.pageTable[pageKey(fileId, pageNo)] = i;
+            return i;
+        }
+        throw runtime_error("buffer pool exhausted: all frames pinned");
+    }
+
+    // The batch that logged the page must reach the journal before the page
+    // reaches its file
+    void writeBack(Partition& p, size_t frame) {
+        Frame& f = frames[frame];
+        pageJournal.harden(f.logged);
+        files[f.fileId]->writePage(f.pageNo, frameData(frame));
+        f.dirty = false;
+        f.changed = false;
+        p.stats.writebacks++;
+    }
+};
+
+inline uint32_t PageRef::pageNo() const { return pool->frames[frame].pageNo; }
+inline char* PageRef::data() const { return pool->frameData(frame); }
+inline void PageRef::markDirty() {
+    BufferPool::Partition& p = pool->partitionOfFrame(frame);
+    lock_guard<mutex> guard(p.latch);
+    pool->markFrameDirty(p, frame);
+}
+inline void PageRef::release() {
+    if (pool != nullptr) {
+        lock_guard<mutex> guard(pool->partitionOfFrame(frame).latch);
+        pool->frames[frame].pinCount--;
+    }
+    pool = nullptr;
+}
+
+size_t bufferPoolBudget() {
+    const char* env = getenv("BOOKSTORE_POOL_BYTES");
+    if (env != nullptr && atoll(env) > 0) return atoll(env);
+    return DEFAULT_POOL_BYTES;
+}
+
+BufferPool bufferPool(bufferPoolBudget());
+
+// Base for structures stored in one paged file behind the shared pool
+class PagedStructure {
+public:
+    uint32_t pageCount() const { return file.pageCount(); }
+    void adviseSequential(bool sequential) { file.adviseSequential(sequential); }
+
+protected:
+    PagedFile file;
+    int fileId = -1;
+
+    // Checks the format stamp of an existing file; throws runtime_error if
+    // the file is of another kind, layout or version
+    bool openFile(const string& path, FileKind kind) {
+        if (!file.open(path)) return false;
+        fileId = bufferPool.attach(&file);
+        if (file.pageCount() == 0) return true;
+        const FileFormat* format = page(0).as<FileFormat>();
+        if (memcmp(format->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0) {
+            throw runtime_error(path + ": not a store file of this format");
+        }
+        if (format->version != STORE_FORMAT_VERSION || format->kind != kind) {
+            throw runtime_error(path + ": store format version " + to_string(format->version) +
+                                ", kind " + to_string(format->kind) + " not supported");
+        }
+        return true;
+    }
+
+    PageRef page(uint32_t pageNo) { return bufferPool.fetch(fileId, pageNo); }
+    PageRef newPage() { return bufferPool.create(fileId, file.allocatePage()); }
+
+    // Creates page 0 of an empty file with its format stamp
+    PageRef newMetaPage(FileKind kind) {
+        PageRef meta = newPage();
+        FileFormat* format = meta.as<FileFormat>();
+        memcpy(format->magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+        format->version = STORE_FORMAT_VERSION;
+        format->kind = kind;
+        return meta;
+    }
+
+    void truncate(uint32_t pageCount) {
+        bufferPool.discard(fileId, pageCount);
+        file.truncate(pageCount);
+    }
+};
+
+struct ArrayMeta {
+    FileFormat format;
+    uint64_t count;
+};
+
+// Fixed-size records appended in order; page 0 holds the record count
+template <class T>
+class AppendArray : public PagedStructure {
+public:
+    static const uint32_t PER_PAGE = PAGE_SIZE / sizeof(T);
+
+    bool open(const string& path) {
+        if (!openFile(path, FILE_ARRAY)) return false;
+        if (file.pageCount() == 0) newMetaPage(FILE_ARRAY);
+        return true;
+    }
+
+    uint64_t size() {
+        return page(0).as<ArrayMeta>()->count;
+    }
+
+    void push_back(const T& record) {
+        PageRef meta = page(0);
+        uint64_t& count = meta.as<ArrayMeta>()->count;
+        uint32_t pageNo = 1 + count / PER_PAGE;
+        PageRef ref = pageNo < file.pageCount() ? page(pageNo) : newPage();
+        ref.as<T>()[count % PER_PAGE] = record;
+        ref.markDirty();
+        count++;
+        meta.markDirty();
+    }
+
+    T get(uint64_t index) {
+        return page(1 + index / PER_PAGE).as<T>()[index % PER_PAGE];
+    }
+};
+
+// ==================== B+ tree ====================
+//
+// Fixed-size keys and values, ordered by compareKey(). Erase does not
+// rebalance, so leaves may become underfull or empty, and splits place new
+// leaves at the end of the file. Every node records the lower bound
+// ("fence") of the key range it covers, which is also its route from the
+// root; the compactor uses it to find a node's parent when moving it.
+//
+// Compaction runs as a sequence of bounded steps. A pass first walks the
+// leaf chain and places leaves on pages 1, 2, ... in key order, absorbing
+// following siblings into underfull leaves. It then packs the remaining
+// pages down and truncates the freed tail of the file.
+
+const uint32_t COMPACTION_CHURN = 256;
+const int COMPACTION_STEP_PAGES = 16;
+
+// Besides idle time, one step runs after every COMPACTION_INTERVAL commands,
+// so input that never leaves stdin empty (a file or heredoc) still compacts
+const int COMPACTION_INTERVAL = 64;
+
+// Leaf and internal node fill used by bulk loading; leaves room for inserts
+const double BULK_FILL = 0.9;
+
+struct NodeHeader {
+    uint8_t type;
+    uint8_t hasFence;
+    uint16_t count;
+    uint32_t next;
+    uint32_t prev;
+};
+
+enum CompactionPhase : uint8_t {
+    COMPACT_LEAVES = 0,
+    COMPACT_PACK = 1
+};
+
+struct TreeMeta {
+    FileFormat format;
+    uint8_t type;
+    uint8_t compactPhase;
+    uint32_t root;
+    uint32_t height;
+    uint64_t size;
+    uint32_t leafCount;
+    uint32_t freePages;
+    uint32_t churn;          // splits and erases since the last pass started
+    uint32_t compactCursor;  // next page to fill; 0 when no pass is running
+};
+
+struct TreeFragmentation {
+    uint32_t pages = 0;
+    uint32_t leaves = 0;
+    uint32_t freePages = 0;
+    uint32_t outOfOrder = 0;  // leaf links that do not point at the next page
+    uint64_t entries = 0;
+    double fill = 0.0;
+};
+
+// Interface of trees regardless of key and value types
+class TreeStructure : public PagedStructure {
+public:
+    virtual ~TreeStructure() {}
+
+    // Performs at most budget page moves of an ongoing or due compaction
+    // pass; returns true while the pass is still running
+    virtual bool compactStep(int budget) = 0;
+
+    virtual TreeFragmentation fragmentation() = 0;
+};
+
+template <class Key, class Value>
+struct LeafNode {
+    static const int CAPACITY =
+        (PAGE_SIZE - sizeof(NodeHeader) - sizeof(Key) - 16) / (sizeof(Key) + sizeof(Value));
+
+    NodeHeader header;
+    Key fence;
+    Key keys[CAPACITY];
+    Value values[CAPACITY];
+};
+
+template <class Key>
+struct InternalNode {
+    static const int CAPACITY =
+        (PAGE_SIZE - sizeof(NodeHeader) - sizeof(Key) - 16) / (sizeof(Key) + sizeof(uint32_t)) - 1;
+
+    NodeHeader header;
+    Key fence;
+    Key keys[CAPACITY];
+    uint32_t children[CAPACITY + 1];
+};
+
+template <class Key, class Value>
+class BPlusTree : public TreeStructure {
+public:
+    typedef LeafNode<Key, Value> Leaf;
+    typedef InternalNode<Key> Internal;
+    static_assert(sizeof(Leaf) <= PAGE_SIZE, "leaf node exceeds page size");
+    static_assert(sizeof(Internal) <= PAGE_SIZE, "internal node exceeds page size");
+
+    // Forward iterator over entries in key order; pins the current leaf
+    class Cursor {
+    public:
+        bool valid() const { return ref.valid(); }
+        const Key& key() const { return ref.as<Leaf>()->keys[index]; }
+        const Value& value() const { return ref.as<Leaf>()->values[index]; }
+
+        void next() {
+            index++;
+            settle();
+        }
+
+    private:
+        friend class BPlusTree;
+        BPlusTree* tree;
+        PageRef ref;
+        int index;
+
+        Cursor(BPlusTree* tree, PageRef ref, int index) : tree(tree), ref(move(ref)), index(index) {
+            settle();
+        }
+
+        // Skips past the end of exhausted (or empty) leaves
+        void settle() {
+            while (ref.valid() && index >= ref.as<Leaf>()->header.count) {
+                uint32_t next = ref.as<Leaf>()->header.next;
+                ref.release();
+                if (next == 0) return;
+                ref = tree->page(next);
+                index = 0;
+            }
+        }
+    };
+
+    bool open(const string& path) {
+        if (!openFile(path, FILE_TREE)) return false;
+        if (file.pageCount() == 0) {
+            PageRef meta = newMetaPage(FILE_TREE);
+            PageRef root = newPage();
+            root.as<NodeHeader>()->type = PAGE_LEAF;
+            TreeMeta* m = meta.as<TreeMeta>();
+            m->type = PAGE_META;
+            m->root = 1;
+            m->height = 1;
+            m->size = 0;
+            m->leafCount = 1;
+        }
+        return true;
+    }
+
+    uint64_t size() { return page(0).as<TreeMeta>()->size; }
+
+    bool find(const Key& key, Value* value = nullptr) {
+        PageRef ref = findLeaf(key);
+        Leaf* leaf = ref.as<Leaf>();
+        int i = lowerBound(leaf, key);
+        if (i == leaf->header.count || compareKey(leaf->keys[i], key) != 0) return false;
+        if (value != nullptr) *value = leaf->values[i];
+        return true;
+    }
+
+    // Fails if the key is already present
+    bool insert(const Key& key, const Value& value) {
+        PageRef meta = page(0);
+        TreeMeta* m = meta.as<TreeMeta>();
+        Split split;
+        if (!insertInto(m->root, key, value, split)) return false;
+        if (split.happened) {
+            PageRef rootRef = newPage();
+            Internal* root = rootRef.as<Internal>();
+            root->header.type = PAGE_INTERNAL;
+            root->header.count = 1;
+            root->keys[0] = split.key;
+            root->children[0] = m->root;
+            root->children[1] = split.page;
+            m->root = rootRef.pageNo();
+            m->height++;
+        }
+        m->size++;
+        meta.markDirty();
+        return true;
+    }
+
+    bool erase(const Key& key) {
+        PageRef ref = findLeaf(key);
+        Leaf* leaf = ref.as<Leaf>();
+        int i = lowerBound(leaf, key);
+        if (i == leaf->header.count || compareKey(leaf->keys[i], key) != 0) return false;
+        int tail = leaf->header.count - i - 1;
+        memmove(&leaf->keys[i], &leaf->keys[i + 1], tail * sizeof(Key));
+        memmove(&leaf->values[i], &leaf->values[i + 1], tail * sizeof(Value));
+        leaf->header.count--;
+        ref.markDirty();
+        PageRef meta = page(0);
+        meta.as<TreeMeta>()->size--;
+        meta.as<TreeMeta>()->churn++;
+        meta.markDirty();
+        return true;
+    }
+
+    // Overwrites the value of an existing key
+    bool update(const Key& key, const Value& value) {
+        PageRef ref = findLeaf(key);
+        Leaf* leaf = ref.as<Leaf>();
+        int i = lowerBound(leaf, key);
+        if (i == leaf->header.count || compareKey(leaf->keys[i], key) != 0) return false;
+        leaf->values[i] = value;
+        ref.markDirty();
+        return true;
+    }
+
+    Cursor begin() {
+        uint32_t pageNo = page(0).as<TreeMeta>()->root;
+        while (true) {
+            PageRef ref = page(pageNo);
+            if (ref.as<NodeHeader>()->type == PAGE_LEAF) return Cursor(this, move(ref), 0);
+            pageNo = ref.as<Internal>()->children[0];
+        }
+    }
+
+    // First entry with key >= the given key
+    Cursor lowerBound(const Key& key) {
+        PageRef ref = findLeaf(key);
+        int i = lowerBound(ref.as<Leaf>(), key);
+        return Cursor(this, move(ref), i);
+    }
+
+    // Replaces the tree's contents with entries supplied in increasing key
+    // order; an entry equal to the previous one is dropped. Leaves are
+    // written to consecutive pages at BULK_FILL, then each internal level is
+    // built bottom-up from the fences of the level below.
+    class Builder {
+    public:
+        explicit Builder(BPlusTree* tree) : tree(tree), entries(0) {
+            tree->truncate(1);
+            startLeaf();
+        }
+
+        void append(const Key& key, const Value& value) {
+            if (entries > 0 && compareKey(lastKey, key) == 0) return;
+            if (leafRef.as<Leaf>()->header.count == leafLimit()) {
+                startLeaf();
+                Leaf* leaf = leafRef.as<Leaf>();
+                leaf->header.hasFence = 1;
+                leaf->fence = key;
+                level.back().first = key;
+            }
+            Leaf* leaf = leafRef.as<Leaf>();
+            leaf->keys[leaf->header.count] = key;
+            leaf->values[leaf->header.count] = value;
+            leaf->header.count++;
+            lastKey = key;
+            entries++;
+        }
+
+        void finish() {
+            leafRef.markDirty();
+            leafRef.release();
+            uint32_t leafCount = level.size();
+            uint32_t height = 1;
+            while (level.size() > 1) {
+                buildLevel();
+                height++;
+            }
+
+            PageRef meta = tree->page(0);
+            TreeMeta* m = meta.as<TreeMeta>();
+            FileFormat format = m->format;
+            memset(m, 0, sizeof(TreeMeta));
+            m->format = format;
+            m->type = PAGE_META;
+            m->root = level[0].second;
+            m->height = height;
+            m->size = entries;
+            m->leafCount = leafCount;
+            meta.markDirty();
+        }
+
+    private:
+        BPlusTree* tree;
+        PageRef leafRef;
+        vector<pair<Key, uint32_t>> level;  // fence and page of each node on the top level
+        Key lastKey;
+        uint64_t entries;
+
+        static int leafLimit() { return max(1, (int)(Leaf::CAPACITY * BULK_FILL)); }
+
+        void startLeaf() {
+            PageRef ref = tree->newPage();
+            Leaf* leaf = ref.as<Leaf>();
+            leaf->header.type = PAGE_LEAF;
+            if (leafRef.valid()) {
+                leafRef.as<Leaf>()->header.next = ref.pageNo();
+                leaf->header.prev = leafRef.pageNo();
+                leafRef.markDirty();
+            }
+            level.push_back({Key(), ref.pageNo()});
+            leafRef = move(ref);
+        }
+
+        // Groups the current level under new internal nodes, spread evenly
+        void buildLevel() {
+            size_t fanout = max(2, (int)((Internal::CAPACITY + 1) * BULK_FILL));
+            size_t nodes = (level.size() + fanout - 1) / fanout;
+            vector<pair<Key, uint32_t>> parents;
+            for (size_t n = 0, at = 0; n < nodes; n++) {
+                size_t take = (level.size() - at + (nodes - n) - 1) / (nodes - n);
+                PageRef ref = tree->newPage();
+                Internal* node = ref.as<Internal>();
+                node->header.type = PAGE_INTERNAL;
+                node->header.count = take - 1;
+                if (at > 0) {
+                    node->header.hasFence = 1;
+                    node->fence = level[at].first;
+                }
+                for (size_t i = 0; i < take; i++) {
+                    node->children[i] = level[at + i].second;
+                    if (i > 0) node->keys[i - 1] = level[at + i].first;
+                }
+                parents.push_back({level[at].first, ref.pageNo()});
+                at += take;
+            }
+            level.swap(parents);
+        }
+    };
+
+    bool compactStep(int budget) override {
+        PageRef metaRef = page(0);
+        TreeMeta* m = metaRef.as<TreeMeta>();
+        if (m->compactCursor == 0) {
+            if (m->churn < COMPACTION_CHURN) return false;
+            m->compactCursor = 1;
+            m->compactPhase = COMPACT_LEAVES;
+            m->churn = 0;
+        }
+        metaRef.markDirty();
+
+        while (budget > 0 && m->compactCursor != 0) {
+            if (m->compactPhase == COMPACT_LEAVES) {
+                placeNextLeaf(m, budget);
+            } else {
+                packNextPage(m, budget);
+            }
+        }
+        return m->compactCursor != 0;
+    }
+
+    TreeFragmentation fragmentation() override {
+        TreeFragmentation stats;
+        stats.pages = file.pageCount();
+        for (uint32_t p = 1; p < stats.pages; p++) {
+            PageRef ref = page(p);
+            const NodeHeader* h = ref.as<NodeHeader>();
+            if (h->type == PAGE_FREE) {
+                stats.freePages++;
+            } else if (h->type == PAGE_LEAF) {
+                stats.leaves++;
+                stats.entries += h->count;
+                if (h->next != 0 && h->next != p + 1) stats.outOfOrder++;
+            }
+        }
+        if (stats.leaves > 0) stats.fill = (double)stats.entries / ((uint64_t)stats.leaves * Leaf::CAPACITY);
+        return stats;
+    }
+
+private:
+    struct Split {
+        bool happened = false;
+        Key key;
+        uint32_t page = 0;
+    };
+
+    static int lowerBound(const Leaf* leaf, const Key& key) {
+        int lo = 0, hi = leaf->header.count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (compareKey(leaf->keys[mid], key) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    // Index of the child whose range contains the key
+    static int childIndex(const Internal* node, const Key& key) {
+        int lo = 0, hi = node->header.count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (compareKey(node->keys[mid], key) <= 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    PageRef findLeaf(const Key& key) {
+        uint32_t pageNo = page(0).as<TreeMeta>()->root;
+        while (true) {
+            PageRef ref = page(pageNo);
+            if (ref.as<NodeHeader>()->type == PAGE_LEAF) return ref;
+            Internal* node = ref.as<Internal>();
+            pageNo = node->children[childIndex(node, key)];
+        }
+    }
+
+    uint32_t leftmostLeaf() {
+        uint32_t pageNo = page(0).as<TreeMeta>()->root;
+        while (true) {
+            PageRef ref = page(pageNo);
+            if (ref.as<NodeHeader>()->type == PAGE_LEAF) return pageNo;
+            pageNo = ref.as<Internal>()->children[0];
+        }
+    }
+
+    // Locates the parent slot pointing at a non-root node by following the
+    // node's fence from the root (nodes without a fence are leftmost)
+    void findParent(uint32_t pageNo, uint32_t& parent, int& slot) {
+        PageRef nodeRef = page(pageNo);
+        const Leaf* node = nodeRef.as<Leaf>();
+        uint32_t current = page(0).as<TreeMeta>()->root;
+        while (true) {
+            PageRef ref = page(current);
+            if (ref.as<NodeHeader>()->type != PAGE_INTERNAL) {
+                throw runtime_error("compaction: node unreachable from root");
+            }
+            const Internal* internal = ref.as<Internal>();
+            int i = node->header.hasFence ? childIndex(internal, node->fence) : 0;
+            if (internal->children[i] == pageNo) {
+                parent = current;
+                slot = i;
+                return;
+            }
+            current = internal->children[i];
+        }
+    }
+
+    // Copies a node to another page and repoints everything referring to it
+    void movePage(TreeMeta* m, uint32_t from, uint32_t to, bool toWasFree) {
+        if (m->root == from) {
+            m->root = to;
+        } else {
+            uint32_t parent;
+            int slot;
+            findParent(from, parent, slot);
+            PageRef parentRef = page(parent);
+            parentRef.as<Internal>()->children[slot] = to;
+            parentRef.markDirty();
+        }
+
+        PageRef src = page(from);
+        PageRef dst = page(to);
+        memcpy(dst.data(), src.data(), PAGE_SIZE);
+        dst.markDirty();
+        const NodeHeader* h = dst.as<NodeHeader>();
+        if (h->type == PAGE_LEAF) {
+            if (h->prev != 0) {
+                PageRef prev = page(h->prev);
+                prev.as<NodeHeader>()->next = to;
+                prev.markDirty();
+            }
+            if (h->next != 0) {
+                PageRef next = page(h->next);
+                next.as<NodeHeader>()->prev = to;
+                next.markDirty();
+            }
+        }
+
+        src.as<NodeHeader>()->type = PAGE_FREE;
+        src.markDirty();
+        m->freePages++;
+        if (toWasFree) m->freePages--;
+    }
+
+    // Absorbs following siblings under the same parent while they fit
+    void mergeFollowing(TreeMeta* m, uint32_t pageNo, int& budget) {
+        while (budget > 0) {
+            PageRef ref = page(pageNo);
+            Leaf* leaf = ref.as<Leaf>();
+            uint32_t nextNo = leaf->header.next;
+            if (nextNo == 0 || m->root == pageNo) return;
+            PageRef nextRef = page(nextNo);
+            Leaf* next = nextRef.as<Leaf>();
+            if (leaf->header.count + next->header.count > Leaf::CAPACITY) return;
+
+            uint32_t parent, nextParent;
+            int slot, nextSlot;
+            findParent(pageNo, parent, slot);
+            findParent(nextNo, nextParent, nextSlot);
+            if (parent != nextParent) return;
+
+            int count = leaf->header.count;
+            copy(next->keys, next->keys + next->header.count, leaf->keys + count);
+            copy(next->values, next->values + next->header.count, leaf->values + count);
+            leaf->header.count += next->header.count;
+            leaf->header.next = next->header.next;
+            if (next->header.next != 0) {
+                PageRef after = page(next->header.next);
+                after.as<NodeHeader>()->prev = pageNo;
+                after.markDirty();
+            }
+            ref.markDirty();
+
+            PageRef parentRef = page(parent);
+            Internal* p = parentRef.as<Internal>();
+            int tail = p->header.count - slot - 1;
+            memmove(&p->keys[slot], &p->keys[slot + 1], tail * sizeof(Key));
+            memmove(&p->children[nextSlot], &p->children[nextSlot + 1], tail * sizeof(uint32_t));
+            p->header.count--;
+            parentRef.markDirty();
+
+            next->header.type = PAGE_FREE;
+            nextRef.markDirty();
+            m->freePages++;
+            m->leafCount--;
+            budget--;
+        }
+    }
+
+    void placeNextLeaf(TreeMeta* m, int& budget) {
+        uint32_t target = m->compactCursor;
+        uint32_t leaf;
+        if (target == 1) {
+            leaf = leftmostLeaf();
+        } else {
+            PageRef prev = page(target - 1);
+            if (prev.as<NodeHeader>()->type != PAGE_LEAF) {
+                // The placed prefix was disturbed; start over
+                m->compactCursor = 1;
+                budget--;
+                return;
+            }
+            leaf = prev.as<NodeHeader>()->next;
+        }
+        if (leaf == 0) {
+            m->compactPhase = COMPACT_PACK;
+            return;
+        }
+        if (leaf < target) {
+            m->compactCursor = 1;
+            budget--;
+            return;
+        }
+
+        mergeFollowing(m, leaf, budget);
+        if (leaf != target) {
+            bool targetFree = page(target).as<NodeHeader>()->type == PAGE_FREE;
+            if (!targetFree) {
+                uint32_t spare = newPage().pageNo();
+                movePage(m, target, spare, false);
+            }
+            movePage(m, leaf, target, true);
+        }
+        m->compactCursor = target + 1;
+        budget--;
+    }
+
+    void packNextPage(TreeMeta* m, int& budget) {
+        uint32_t target = m->compactCursor;
+        uint32_t pages = file.pageCount();
+        budget--;
+        if (target < pages && page(target).as<NodeHeader>()->type != PAGE_FREE) {
+            m->compactCursor = target + 1;
+            return;
+        }
+
+        uint32_t live = target + 1;
+        while (live < pages && page(live).as<NodeHeader>()->type == PAGE_FREE) live++;
+        if (live >= pages) {
+            // Everything from target on is free
+            m->freePages -= pages - min(target, pages);
+            m->compactCursor = 0;
+            truncate(min(target, pages));
+            return;
+        }
+        movePage(m, live, target, true);
+        m->compactCursor = target + 1;
+    }
+
+    bool insertInto(uint32_t pageNo, const Key& key, const Value& value, Split& split) {
+        PageRef ref = page(pageNo);
+        if (ref.as<NodeHeader>()->type == PAGE_LEAF) return insertIntoLeaf(ref, key, value, split);
+
+        Internal* node = ref.as<Internal>();
+        int child = childIndex(node, key);
+        Split childSplit;
+        if (!insertInto(node->children[child], key, value, childSplit)) return false;
+        if (!childSplit.happened) return true;
+
+        ref.markDirty();
+        int count = node->header.count;
+        if (count < Internal::CAPACITY) {
+            memmove(&node->keys[child + 1], &node->keys[child], (count - child) * sizeof(Key));
+            memmove(&node->children[child + 2], &node->children[child + 1],
+                    (count - child) * sizeof(uint32_t));
+            node->keys[child] = childSplit.key;
+            node->children[child + 1] = childSplit.page;
+            node->header.count++;
+            return true;
+        }
+
+        // Full: lay out all keys and children, then push the middle key up
+        vector<Key> keys(node->keys, node->keys + count);
+        vector<uint32_t> children(node->children, node->children + count + 1);
+        keys.insert(keys.begin() + child, childSplit.key);
+        children.insert(children.begin() + child + 1, childSplit.page);
+
+        int mid = keys.size() / 2;
+        PageRef rightRef = newPage();
+        Internal* right = rightRef.as<Internal>();
+        right->header.type = PAGE_INTERNAL;
+        right->header.hasFence = 1;
+        right->fence = keys[mid];
+        right->header.count = keys.size() - mid - 1;
+        copy(keys.begin() + mid + 1, keys.end(), right->keys);
+        copy(children.begin() + mid + 1, children.end(), right->children);
+
+        node->header.count = mid;
+        copy(keys.begin(), keys.begin() + mid, node->keys);
+        copy(children.begin(), children.begin() + mid + 1, node->children);
+
+        split.happened = true;
+        split.key = keys[mid];
+        split.page = rightRef.pageNo();
+        return true;
+    }
+
+    bool insertIntoLeaf(PageRef& ref, const Key& key, const Value& value, Split& split) {
+        Leaf* leaf = ref.as<Leaf>();
+        int pos = lowerBound(leaf, key);
+        if (pos < leaf->header.count && compareKey(leaf->keys[pos], key) == 0) return false;
+        ref.markDirty();
+
+        PageRef rightRef;
+        Leaf* target = leaf;
+        if (leaf->header.count == Leaf::CAPACITY) {
+            // Move the upper half into a new right sibling
+            int moveFrom = Leaf::CAPACITY / 2;
+            rightRef = newPage();
+            Leaf* right = rightRef.as<Leaf>();
+            right->header.type = PAGE_LEAF;
+            right->header.count = Leaf::CAPACITY - moveFrom;
+            copy(leaf->keys + moveFrom, leaf->keys + Leaf::CAPACITY, right->keys);
+            copy(leaf->values + moveFrom, leaf->values + Leaf::CAPACITY, right->values);
+            leaf->header.count = moveFrom;
+
+            right->header.hasFence = 1;
+            right->fence = right->keys[0];
+            right->header.prev = ref.pageNo();
+            right->header.next = leaf->header.next;
+            if (leaf->header.next != 0) {
+                PageRef nextRef = page(leaf->header.next);
+                nextRef.as<Leaf>()->header.prev = rightRef.pageNo();
+                nextRef.markDirty();
+            }
+            leaf->header.next = rightRef.pageNo();
+
+            split.happened = true;
+            split.key = right->keys[0];
+            split.page = rightRef.pageNo();
+            PageRef meta = page(0);
+            meta.as<TreeMeta>()->leafCount++;
+            meta.as<TreeMeta>()->churn++;
+            meta.markDirty();
+            if (pos > moveFrom) {
+                target = right;
+                pos -= moveFrom;
+            }
+        }
+
+        int tail = target->header.count - pos;
+        memmove(&target->keys[pos + 1], &target->keys[pos], tail * sizeof(Key));
+        memmove(&target->values[pos + 1], &target->values[pos], tail * sizeof(Value));
+        target->keys[pos] = key;
+        target->values[pos] = value;
+        target->header.count++;
+        return true;
+    }
+};
+
+// ==================== Transaction history ====================
+//
+// Amounts are kept as integer cents. The newest transactions sit unencoded
+// in the header page; every SEGMENT_SIZE of them are sealed into an
+// immutable segment appended to the data pages:
+//   sign bitmap (bit set = income) | zigzag varint deltas of the amounts |
+//   varint deltas of the timestamps
+// Timestamps never decrease. Each segment has a footer with its position,
+// time span, sums and the running sums before it, so summing a range of
+// positions or times only decodes the segments that straddle its ends.
+
+const uint32_t SEGMENT_SIZE = 256;
+const size_t LEDGER_STREAMS = 4;
+
+// Largest amount of one transaction, in cents. Deltas between two entries
+// then still fit in 64 bits; running sums are kept in 128 bits, so they
+// cannot overflow either.
+const int64_t MAX_TRANSACTION_CENTS = 1000000000000000000;
+
+typedef __int128 CentSum;
+
+struct LedgerEntry {
+    int64_t cents;
+    bool isIncome;
+    int64_t time;
+};
+
+struct SegmentFooter {
+    uint64_t firstIndex;
+    uint64_t offset;  // byte offset within the data pages
+    uint32_t count;
+    uint32_t length;
+    CentSum income;
+    CentSum expense;
+    CentSum incomeBefore;   // sums of all earlier segments
+    CentSum expenseBefore;
+    int64_t firstTime;
+    int64_t lastTime;
+};
+
+struct LedgerHeader {
+    FileFormat format;
+    uint64_t count;
+    uint64_t dataBytes;
+    CentSum income;
+    CentSum expense;
+    int64_t lastTime;
+    int64_t tailBase;  // tail timestamps are offsets from this
+    uint32_t tailCount;
+    uint8_t tailSigns[SEGMENT_SIZE / 8];
+    int64_t tailCents[SEGMENT_SIZE];
+    uint32_t tailTimes[SEGMENT_SIZE];
+};
+
+// False if the amount is too large (or not a number) for the ledger; such
+// a buy or import is rejected before it changes anything
+bool fitsLedger(double amount) {
+    return fabs(amount) * 100 <= (double)MAX_TRANSACTION_CENTS;
+}
+
+// amount must pass fitsLedger
+int64_t toCents(double amount) {
+    return llround(amount * 100);
+}
+
+void putVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+uint64_t getVarint(const string& in, size_t& pos) {
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = in[pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+}
+
+uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+class TransactionLedger : public PagedStructure {
+public:
+    static_assert(sizeof(LedgerHeader) <= PAGE_SIZE, "ledger header exceeds page size");
+
+    bool open(const string& path, const string& indexPath) {
+        if (!openFile(path, FILE_LEDGER) || !footers.open(indexPath)) return false;
+        if (file.pageCount() == 0) newMetaPage(FILE_LEDGER);
+        return true;
+    }
+
+    uint64_t size() {
+        publish();
+        return page(0).as<LedgerHeader>()->count;
+    }
+
+    // Safe to call from several threads. An append that finds the ledger
+    // busy is staged in the buffer of its stream (writers pass their
+    // catalog shard) instead of waiting; whoever takes the ledger next
+    // appends the staged entries too. Readers publish them first. A single
+    // writer never stages, so a checkpoint between commands sees them all.
+    void push_back(const Transaction& trans, size_t stream = 0) {
+        unique_lock<mutex> guard(appendLatch, try_to_lock);
+        if (!guard.owns_lock()) {
+            Stream& s = streams[stream % LEDGER_STREAMS];
+            lock_guard<mutex> staging(s.latch);
+            s.pending.push_back(trans);
+            staged.fetch_add(1, memory_order_release);
+            return;
+        }
+        PageRef ref = page(0);
+        append(ref.as<LedgerHeader>(), trans);
+        appendStaged(ref.as<LedgerHeader>());
+        ref.markDirty();
+    }
+
+    // Appends every staged entry
+    void publish() {
+        if (staged.load(memory_order_acquire) == 0) return;
+        lock_guard<mutex> guard(appendLatch);
+        PageRef ref = page(0);
+        appendStaged(ref.as<LedgerHeader>());
+        ref.markDirty();
+    }
+
+    // All-time sums in cents
+    void totals(CentSum& income, CentSum& expense) {
+        publish();
+        LedgerHeader* header = page(0).as<LedgerHeader>();
+        income = header->income;
+        expense = header->expense;
+    }
+
+    // Sums in cents of the newest count transactions; whole segments are
+    // taken from their footers
+    void sumLast(uint64_t count, CentSum& income, CentSum& expense) {
+        publish();
+        income = expense = 0;
+        {
+            PageRef ref = page(0);
+            LedgerHeader* header = ref.as<LedgerHeader>();
+            uint32_t fromTail = min<uint64_t>(count, header->tailCount);
+            for (uint32_t i = header->tailCount - fromTail; i < header->tailCount; i++) {
+                bool isIncome = header->tailSigns[i / 8] & (1 << (i % 8));
+                (isIncome ? income : expense) += header->tailCents[i];
+            }
+            count -= fromTail;
+        }
+
+        for (uint64_t s = footers.size(); count > 0 && s > 0; s--) {
+            SegmentFooter footer = footers.get(s - 1);
+            if (footer.count <= count) {
+                income += footer.income;
+                expense += footer.expense;
+                count -= footer.count;
+                continue;
+            }
+            vector<LedgerEntry> entries;
+            decode(footer, entries);
+            for (size_t i = entries.size() - count; i < entries.size(); i++) {
+                (entries[i].isIncome ? income : expense) += entries[i].cents;
+            }
+            count = 0;
+        }
+    }
+
+    // Sums in cents of the transactions stamped in [from, to]
+    void sumBetween(int64_t from, int64_t to, CentSum& income, CentSum& expense) {
+        publish();
+        CentSum incomeBefore, expenseBefore;
+        sumBefore(from, incomeBefore, expenseBefore);
+        sumBefore(to == INT64_MAX ? to : to + 1, income, expense);
+        income -= incomeBefore;
+        expense -= expenseBefore;
+    }
+
+    // Calls visit(entry) for the transactions at positions [first, last),
+    // oldest first, decoding only the segments that hold them. Every
+    // segment holds SEGMENT_SIZE transactions.
+    template <class Visit>
+    void forRange(uint64_t first, uint64_t last, Visit visit) {
+        publish();
+        vector<LedgerEntry> entries;
+        for (uint64_t s = first / SEGMENT_SIZE; first < last && s < footers.size(); s++) {
+            SegmentFooter footer = footers.get(s);
+            decode(footer, entries);
+            for (; first < last && first < footer.firstIndex + footer.count; first++) {
+                visit(entries[first - footer.firstIndex]);
+            }
+        }
+        if (first >= last) return;
+        PageRef ref = page(0);
+        const LedgerHeader* header = ref.as<LedgerHeader>();
+        uint64_t tailFirst = header->count - header->tailCount;
+        for (; first < last && first < header->count; first++) {
+            uint32_t i = first - tailFirst;
+            LedgerEntry entry;
+            entry.cents = header->tailCents[i];
+            entry.isIncome = header->tailSigns[i / 8] & (1 << (i % 8));
+            entry.time = header->tailBase + header->tailTimes[i];
+            visit(entry);
+        }
+    }
+
+    uint64_t segmentCount() { return footers.size(); }
+    uint64_t encodedBytes() { return page(0).as<LedgerHeader>()->dataBytes; }
+    PagedStructure& segmentIndex() { return footers; }
+
+private:
+    // Entries staged by appends that found the ledger busy
+    struct Stream {
+        mutex latch;
+        vector<Transaction> pending;
+    };
+
+    AppendArray<SegmentFooter> footers;
+    mutex appendLatch;
+    Stream streams[LEDGER_STREAMS];
+    atomic<size_t> staged{0};
+
+    // Caller holds appendLatch
+    void append(LedgerHeader* header, const Transaction& trans) {
+        int64_t cents = toCents(trans.amount);
+        // Clock steps backwards are absorbed so timestamps stay sorted
+        int64_t time = max(trans.timestamp, header->lastTime);
+        uint32_t i = header->tailCount++;
+        if (i == 0) header->tailBase = time;
+        header->tailCents[i] = cents;
+        header->tailTimes[i] = (uint32_t)(time - header->tailBase);
+        header->lastTime = time;
+        if (trans.isIncome) {
+            header->tailSigns[i / 8] |= 1 << (i % 8);
+            header->income += cents;
+        } else {
+            header->tailSigns[i / 8] &= ~(1 << (i % 8));
+            header->expense += cents;
+        }
+        header->count++;
+        if (header->tailCount == SEGMENT_SIZE) seal(header);
+    }
+
+    // Caller holds appendLatch
+    void appendStaged(LedgerHeader* header) {
+        if (staged.load(memory_order_acquire) == 0) return;
+        vector<Transaction> pending;
+        for (Stream& s : streams) {
+            {
+                lock_guard<mutex> staging(s.latch);
+                pending.swap(s.pending);
+            }
+            staged.fetch_sub(pending.size(), memory_order_relaxed);
+            for (const auto& trans : pending) append(header, trans);
+            pending.clear();
+        }
+    }
+
+    // Sums of the transactions stamped before time: binary search for the
+    // first segment ending at or after it, then decode only that segment
+    void sumBefore(int64_t time, CentSum& income, CentSum& expense) {
+        uint64_t lo = 0, hi = footers.size();
+        while (lo < hi) {
+            uint64_t mid = (lo + hi) / 2;
+            if (footers.get(mid).lastTime < time) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (lo < footers.size()) {
+            SegmentFooter footer = footers.get(lo);
+            income = footer.incomeBefore;
+            expense = footer.expenseBefore;
+            if (footer.firstTime >= time) return;
+            vector<LedgerEntry> entries;
+            decode(footer, entries);
+            for (const auto& entry : entries) {
+                if (entry.time >= time) break;
+                (entry.isIncome ? income : expense) += entry.cents;
+            }
+            return;
+        }
+
+        // Every sealed transaction is earlier; take the totals and drop the
+        // tail entries that are not
+        PageRef ref = page(0);
+        LedgerHeader* header = ref.as<LedgerHeader>();
+        income = header->income;
+        expense = header->expense;
+        for (uint32_t i = header->tailCount; i > 0; i--) {
+            if (header->tailBase + header->tailTimes[i - 1] < time) break;
+            bool isIncome = header->tailSigns[(i - 1) / 8] & (1 << ((i - 1) % 8));
+            (isIncome ? income : expense) -= header->tailCents[i - 1];
+        }
+    }
+
+    void seal(LedgerHeader* header) {
+        uint32_t n = header->tailCount;
+        string bytes(header->tailSigns, header->tailSigns + (n + 7) / 8);
+        int64_t prev = 0;
+        SegmentFooter footer;
+        footer.income = footer.expense = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            int64_t cents = header->tailCents[i];
+            putVarint(bytes, zigzag(cents - prev));
+            prev = cents;
+            bool isIncome = header->tailSigns[i / 8] & (1 << (i % 8));
+            (isIncome ? footer.income : footer.expense) += cents;
+        }
+        for (uint32_t i = 1; i < n; i++) {
+            putVarint(bytes, header->tailTimes[i] - header->tailTimes[i - 1]);
+        }
+
+        footer.incomeBefore = header->income - footer.income;
+        footer.expenseBefore = header->expense - footer.expense;
+        footer.firstTime = header->tailBase;
+        footer.lastTime = header->tailBase + header->tailTimes[n - 1];
+        footer.firstIndex = header->count - n;
+        footer.offset = header->dataBytes;
+        footer.count = n;
+        footer.length = bytes.size();
+        writeBytes(footer.offset, bytes);
+        footers.push_back(footer);
+
+        header->dataBytes += bytes.size();
+        header->tailCount = 0;
+        memset(header->tailSigns, 0, sizeof(header->tailSigns));
+    }
+
+    void writeBytes(uint64_t offset, const string& bytes) {
+        for (size_t done = 0; done < bytes.size();) {
+            uint32_t pageNo = 1 + (offset + done) / PAGE_SIZE;
+            size_t at = (offset + done) % PAGE_SIZE;
+            size_t chunk = min<size_t>(PAGE_SIZE - at, bytes.size() - done);
+            PageRef ref = pageNo < file.pageCount() ? page(pageNo) : newPage();
+            memcpy(ref.data() + at, bytes.data() + done, chunk);
+            ref.markDirty();
+            done += chunk;
+        }
+    }
+
+    string readBytes(uint64_t offset, size_t length) {
+        string bytes;
+        while (bytes.size() < length) {
+            uint64_t pos = offset + bytes.size();
+            size_t at = pos % PAGE_SIZE;
+            size_t chunk = min<size_t>(PAGE_SIZE - at, length - bytes.size());
+            PageRef ref = page(1 + pos / PAGE_SIZE);
+            bytes.append(ref.data() + at, chunk);
+        }
+        return bytes;
+    }
+
+    void decode(const SegmentFooter& footer, vector<LedgerEntry>& entries) {
+        string bytes = readBytes(footer.offset, footer.length);
+        size_t pos = (footer.count + 7) / 8;
+        int64_t prev = 0;
+        entries.resize(footer.count);
+        for (uint32_t i = 0; i < footer.count; i++) {
+            prev += unzigzag(getVarint(bytes, pos));
+            entries[i].cents = prev;
+            entries[i].isIncome = bytes[i / 8] & (1 << (i % 8));
+        }
+        int64_t time = footer.firstTime;
+        for (uint32_t i = 0; i < footer.count; i++) {
+            if (i > 0) time += getVarint(bytes, pos);
+            entries[i].time = time;
+        }
+    }
+};
+
+// ==================== Bloom filters ====================
+//
+// Blocked Bloom filter over string keys: each key sets BLOOM_HASHES bits
+// inside a single 64-byte block, so a lookup touches one cache line of one
+// page. Removed keys leave their bits set; the owner rebuilds the filter
+// from its tree once removals pile up or it outgrows its sizing.
+
+const uint32_t BLOOM_BLOCK_BYTES = 64;
+const uint32_t BLOOM_BLOCKS_PER_PAGE = PAGE_SIZE / BLOOM_BLOCK_BYTES;
+const uint32_t BLOOM_BITS_PER_KEY = 10;
+const int BLOOM_HASHES = 7;
+const uint64_t BLOOM_MIN_CAPACITY = 1024;
+
+struct BloomHeader {
+    FileFormat format;
+    uint64_t blocks;
+    uint64_t capacity;  // keys the current size was chosen for
+    uint64_t added;     // keys added since the last rebuild
+    uint64_t removed;   // keys removed since the last rebuild
+};
+
+struct BloomStats {
+    uint64_t lookups = 0;
+    uint64_t negatives = 0;
+    uint64_t falsePositives = 0;
+};
+
+// Filter bits are read and set with atomic word operations, so lookups
+// need no lock while another thread adds a key
+
+class BloomFilter : public PagedStructure {
+public:
+    bool open(const string& path) {
+        if (!openFile(path, FILE_BLOOM)) return false;
+        if (file.pageCount() == 0) newMetaPage(FILE_BLOOM);
+        return true;
+    }
+
+    // Keys the filter currently vouches for
+    uint64_t keys() {
+        BloomHeader* h = page(0).as<BloomHeader>();
+        return h->added - h->removed;
+    }
+
+    bool needsRebuild() {
+        BloomHeader* h = page(0).as<BloomHeader>();
+        return h->blocks == 0 || h->added > h->capacity ||
+               h->removed > max<uint64_t>(64, h->added / 4);
+    }
+
+    // Empties the filter and sizes it for the given number of keys
+    void reset(uint64_t expectedKeys) {
+        truncate(1);
+        uint64_t capacity = max(BLOOM_MIN_CAPACITY, 2 * expectedKeys);
+        uint64_t blocks = (capacity * BLOOM_BITS_PER_KEY + BLOOM_BLOCK_BYTES * 8 - 1) /
+                          (BLOOM_BLOCK_BYTES * 8);
+        for (uint64_t p = 0; p < (blocks + BLOOM_BLOCKS_PER_PAGE - 1) / BLOOM_BLOCKS_PER_PAGE; p++) {
+            newPage();
+        }
+        PageRef meta = page(0);
+        BloomHeader* h = meta.as<BloomHeader>();
+        h->blocks = blocks;
+        h->capacity = capacity;
+        h->added = 0;
+        h->removed = 0;
+        meta.markDirty();
+    }
+
+    void add(const char* key) {
+        lock_guard<mutex> guard(latch);
+        uint64_t hash = hashKey(key);
+        PageRef meta = page(0);
+        BloomHeader* h = meta.as<BloomHeader>();
+        PageRef ref = blockPage(h, hash);
+        uint64_t* block = blockWords(ref, h, hash);
+        uint64_t bits = bitHash(hash);
+        for (int i = 0; i < BLOOM_HASHES; i++, bits >>= 9) {
+            __atomic_fetch_or(&block[(bits & 511) / 64], 1ull << (bits & 63), __ATOMIC_RELAXED);
+        }
+        ref.markDirty();
+        h->added++;
+        meta.markDirty();
+    }
+
+    void remove() {
+        lock_guard<mutex> guard(latch);
+        PageRef meta = page(0);
+        meta.as<BloomHeader>()->removed++;
+        meta.markDirty();
+    }
+
+    // False means the key is certainly absent. Takes no lock; the filter
+    // must not be reset while lookups run.
+    bool mayContain(const char* key) {
+        lookups.fetch_add(1, memory_order_relaxed);
+        uint64_t hash = hashKey(key);
+        PageRef meta = page(0);
+        BloomHeader* h = meta.as<BloomHeader>();
+        PageRef ref = blockPage(h, hash);
+        uint64_t* block = blockWords(ref, h, hash);
+        uint64_t bits = bitHash(hash);
+        for (int i = 0; i < BLOOM_HASHES; i++, bits >>= 9) {
+            if (!(__atomic_load_n(&block[(bits & 511) / 64], __ATOMIC_RELAXED) & (1ull << (bits & 63)))) {
+                negatives.fetch_add(1, memory_order_relaxed);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Called when a lookup the filter let through missed anyway
+    void noteFalsePositive() { falsePositives.fetch_add(1, memory_order_relaxed); }
+
+    BloomStats statistics() const {
+        BloomStats stats;
+        stats.lookups = lookups.load(memory_order_relaxed);
+        stats.negatives = negatives.load(memory_order_relaxed);
+        stats.falsePositives = falsePositives.load(memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    mutex latch;  // serializes updates; lookups go without it
+    atomic<uint64_t> lookups{0};
+    atomic<uint64_t> negatives{0};
+    atomic<uint64_t> falsePositives{0};
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ull;
+        return x ^ (x >> 33);
+    }
+
+    static uint64_t hashKey(const char* key) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (; *key; key++) hash = (hash ^ (unsigned char)*key) * 0x100000001b3ull;
+        return mix(hash);
+    }
+
+    // Seven 9-bit bit positions within the block
+    static uint64_t bitHash(uint64_t hash) { return mix(hash ^ 0x9e3779b97f4a7c15ull); }
+
+    static uint64_t blockOf(const BloomHeader* h, uint64_t hash) {
+        return (hash >> 32) * h->blocks >> 32;
+    }
+
+    PageRef blockPage(const BloomHeader* h, uint64_t hash) {
+        return page(1 + blockOf(h, hash) / BLOOM_BLOCKS_PER_PAGE);
+    }
+
+    static uint64_t* blockWords(const PageRef& ref, const BloomHeader* h, uint64_t hash) {
+        return reinterpret_cast<uint64_t*>(ref.data() + blockOf(h, hash) % BLOOM_BLOCKS_PER_PAGE *
+                                                            BLOOM_BLOCK_BYTES);
+    }
+};
+
+// ==================== Keys ====================
+
+// Copies src into a zero-filled field of size bytes, truncating it so the
+// field stays NUL-terminated
+void copyField(char* dst, size_t size, const char* src) {
+    memcpy(dst, src, strnlen(src, size - 1));
+}
+
+struct IsbnKey {
+    char value[21];
+
+    IsbnKey() { memset(value, 0, sizeof(value)); }
+    explicit IsbnKey(const char* s) {
+        memset(value, 0, sizeof(value));
+        copyField(value, sizeof(value), s);
+    }
+};
+
+struct UserKey {
+    char value[31];
+
+    UserKey() { memset(value, 0, sizeof(value)); }
+    explicit UserKey(const char* s) {
+        memset(value, 0, sizeof(value));
+        copyField(value, sizeof(value), s);
+    }
+};
+
+// (text, ISBN) entry of a name/author/keyword index
+struct TextKey {
+    char text[61];
+    char isbn[21];
+
+    TextKey() {
+        memset(text, 0, sizeof(text));
+        memset(isbn, 0, sizeof(isbn));
+    }
+    TextKey(const char* t, const char* i) {
+        memset(text, 0, sizeof(text));
+        memset(isbn, 0, sizeof(isbn));
+        copyField(text, sizeof(text), t);
+        copyField(isbn, sizeof(isbn), i);
+    }
+};
+
+// (gram, ISBN) entry of the n-gram index
+struct GramKey {
+    uint32_t gram;
+    char isbn[21];
+
+    GramKey() : gram(0) { memset(isbn, 0, sizeof(isbn)); }
+    GramKey(uint32_t g, const char* i) : gram(g) {
+        memset(isbn, 0, sizeof(isbn));
+        copyField(isbn, sizeof(isbn), i);
+    }
+};
+
+// (price, ISBN) entry of the price index
+struct PriceKey {
+    double price;
+    char isbn[21];
+
+    PriceKey() : price(0) { memset(isbn, 0, sizeof(isbn)); }
+    PriceKey(double p, const char* i) : price(p) {
+        memset(isbn, 0, sizeof(isbn));
+        copyField(isbn, sizeof(isbn), i);
+    }
+};
+
+int compareKey(const IsbnKey& a, const IsbnKey& b) {
+    return strcmp(a.value, b.value);
+}
+
+int compareKey(const UserKey& a, const UserKey& b) {
+    return strcmp(a.value, b.value);
+}
+
+int compareKey(const TextKey& a, const TextKey& b) {
+    int c = strcmp(a.text, b.text);
+    return c != 0 ? c : strcmp(a.isbn, b.isbn);
+}
+
+int compareKey(const GramKey& a, const GramKey& b) {
+    if (a.gram != b.gram) return a.gram < b.gram ? -1 : 1;
+    return strcmp(a.isbn, b.isbn);
+}
+
+int compareKey(const PriceKey& a, const PriceKey& b) {
+    if (a.price != b.price) return a.price < b.price ? -1 : 1;
+    return strcmp(a.isbn, b.isbn);
+}
+
+// ==================== Sharded catalog ====================
+//
+// Books are spread over CATALOG_SHARDS trees by a hash of the ISBN, each in
+// its own file and behind its own lock, so purchases and imports of
+// different books can proceed in parallel. Point operations are safe from
+// several threads; ordered scans merge the shards on the fly and are only
+// used from the command thread.
+
+const int CATALOG_SHARDS = 4;
+
+class Catalog {
+public:
+    typedef BPlusTree<IsbnKey, Book> Shard;
+
+    // Walks all shards in ISBN order, always advancing the smallest head
+    class Cursor {
+    public:
+        bool valid() const { return current >= 0; }
+        const IsbnKey& key() const { return heads[current].key(); }
+        const Book& value() const { return heads[current].value(); }
+
+        void next() {
+            heads[current].next();
+            pick();
+        }
+
+    private:
+        friend class Catalog;
+        vector<Shard::Cursor> heads;
+        int current;
+
+        void pick() {
+            current = -1;
+            for (int i = 0; i < (int)heads.size(); i++) {
+                if (!heads[i].valid()) continue;
+                if (current < 0 || compareKey(heads[i].key(), heads[current].key()) < 0) current = i;
+            }
+        }
+    };
+
+    // Opens prefix_0.dat ... prefix_(N-1).dat
+    bool open(const string& prefix) {
+        for (int i = 0; i < CATALOG_SHARDS; i++) {
+            if (!shards[i].open(shardFile(prefix, i))) return false;
+        }
+        return true;
+    }
+
+    static string shardFile(const string& prefix, int shard) {
+        return prefix + "_" + to_string(shard) + ".dat";
+    }
+
+    static int shardOf(const char* isbn) {
+        uint32_t hash = 2166136261u;
+        for (; *isbn; isbn++) hash = (hash ^ (unsigned char)*isbn) * 16777619u;
+        return hash % CATALOG_SHARDS;
+    }
+
+    Shard& shard(int i) { return shards[i]; }
+
+    uint64_t size() {
+        uint64_t total = 0;
+        for (auto& s : shards) total += s.size();
+        return total;
+    }
+
+    bool find(const IsbnKey& key, Book* book = nullptr) {
+        int s = shardOf(key.value);
+        lock_guard<mutex> guard(locks[s]);
+        return shards[s].find(key, book);
+    }
+
+    bool insert(const IsbnKey& key, const Book& book) {
+        int s = shardOf(key.value);
+        lock_guard<mutex> guard(locks[s]);
+        return shards[s].insert(key, book);
+    }
+
+    bool erase(const IsbnKey& key) {
+        int s = shardOf(key.value);
+        lock_guard<mutex> guard(locks[s]);
+        return shards[s].erase(key);
+    }
+
+    bool update(const IsbnKey& key, const Book& book) {
+        int s = shardOf(key.value);
+        lock_guard<mutex> guard(locks[s]);
+        return shards[s].update(key, book);
+    }
+
+    // Read-modify-write of one book under its shard lock. change(book)
+    // returns false to leave the book as it was; false if absent or refused.
+    template <class Change>
+    bool modify(const IsbnKey& key, Change change) {
+        int s = shardOf(key.value);
+        lock_guard<mutex> guard(locks[s]);
+        Book book;
+        if (!shards[s].find(key, &book) || !change(book)) return false;
+        shards[s].update(key, book);
+        return true;
+    }
+
+    Cursor begin() {
+        Cursor c;
+        for (auto& s : shards) c.heads.push_back(s.begin());
+        c.pick();
+        return c;
+    }
+
+    // First book with ISBN >= key
+    Cursor lowerBound(const IsbnKey& key) {
+        Cursor c;
+        for (auto& s : shards) c.heads.push_back(s.lowerBound(key));
+        c.pick();
+        return c;
+    }
+
+    void adviseSequential(bool sequential) {
+        for (auto& s : shards) s.adviseSequential(sequential);
+    }
+
+private:
+    Shard shards[CATALOG_SHARDS];
+    mutex locks[CATALOG_SHARDS];
+};
+
+// ==================== External sorting ====================
+
+const size_t SORT_BLOCK_BYTES = 64 << 10;
+const size_t SORT_MAX_FAN_IN = 64;
+
+// Scratch file holding the sorted runs of one or more ExternalSorters, so a
+// sort costs a single extra file however many runs it spills. Space is
+// reserved per run up front and released (hole-punched) once the run has
+// been merged; the file is removed when closed.
+class SpillFile {
+public:
+    explicit SpillFile(const string& path) : path(path), end(0) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw runtime_error("cannot create " + path);
+    }
+
+    ~SpillFile() {
+        ::close(fd);
+        remove(path.c_str());
+    }
+
+    // Reserves length bytes at the end of the file and returns their offset
+    uint64_t reserve(uint64_t length) {
+        uint64_t offset = end;
+        end += length;
+        return offset;
+    }
+
+    void write(uint64_t offset, const char* data, size_t length) {
+        for (size_t done = 0; done < length;) {
+            ssize_t n = pwrite(fd, data + done, length - done, (off_t)(offset + done));
+            if (n <= 0) throw runtime_error("cannot write " + path);
+            done += n;
+        }
+    }
+
+    void read(uint64_t offset, char* data, size_t length) {
+        for (size_t done = 0; done < length;) {
+            ssize_t n = pread(fd, data + done, length - done, (off_t)(offset + done));
+            if (n <= 0) throw runtime_error("cannot read " + path);
+            done += n;
+        }
+    }
+
+    // Gives the disk space of a merged run back; best effort
+    void release(uint64_t offset, uint64_t length) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length);
+#else
+        (void)offset;
+        (void)length;
+#endif
+    }
+
+private:
+    string path;
+    int fd;
+    uint64_t end;
+};
+
+// Sorts fixed-size records in bounded memory: full buffers are sorted and
+// spilled as runs into a SpillFile, which are then merged through a heap,
+// in several passes if there are more runs than read buffers fit in
+// memory. Records that compare equal keep the order they were added in.
+template <class T, class Less>
+class ExternalSorter {
+public:
+    ExternalSorter(SpillFile& spill, size_t memoryBytes, Less less)
+        : spill(spill),
+          limit(max<size_t>(memoryBytes / sizeof(T), 1)),
+          fanIn(min(max<size_t>(memoryBytes / SORT_BLOCK_BYTES, 4), SORT_MAX_FAN_IN)),
+          less(less) {}
+
+    void add(const T& record) {
+        buffer.push_back(record);
+        if (buffer.size() >= limit) spillBuffer();
+    }
+
+    // Calls visit(record) for every record in sorted order
+    template <class Visit>
+    void merge(Visit visit) {
+        if (runs.empty()) {
+            stable_sort(buffer.begin(), buffer.end(), less);
+            for (const auto& record : buffer) visit(record);
+            vector<T>().swap(buffer);
+            return;
+        }
+        spillBuffer();
+        vector<T>().swap(buffer);
+
+        // Merge neighbouring groups of runs until a single pass suffices;
+        // groups keep their order so ties still resolve by add order
+        while (runs.size() > fanIn) {
+            deque<Run> merged;
+            while (!runs.empty()) {
+                size_t count = min(fanIn, runs.size());
+                Run out = {0, 0};
+                for (size_t i = 0; i < count; i++) out.records += runs[i].records;
+                out.offset = spill.reserve(out.records * sizeof(T));
+
+                vector<char> block(SORT_BLOCK_BYTES - SORT_BLOCK_BYTES % sizeof(T));
+                size_t used = 0;
+                uint64_t written = 0;
+                auto flush = [&]() {
+                    spill.write(out.offset + written, block.data(), used);
+                    written += used;
+                    used = 0;
+                };
+                mergeRuns(count, [&](const T& record) {
+                    if (used == block.size()) flush();
+                    memcpy(&block[used], &record, sizeof(T));
+                    used += sizeof(T);
+                });
+                flush();
+                merged.push_back(out);
+            }
+            runs.swap(merged);
+        }
+        mergeRuns(runs.size(), visit);
+    }
+
+private:
+    // A sorted run stored in the spill file
+    struct Run {
+        uint64_t offset;
+        uint64_t records;
+    };
+
+    // Reads one run back in large blocks
+    struct RunReader {
+        Run run;
+        uint64_t consumed;
+        vector<char> block;
+        size_t pos;
+        size_t filled;
+    };
+
+    SpillFile& spill;
+    size_t limit;
+    size_t fanIn;
+    Less less;
+    vector<T> buffer;
+    deque<Run> runs;
+
+    void spillBuffer() {
+        if (buffer.empty()) return;
+        stable_sort(buffer.begin(), buffer.end(), less);
+        size_t bytes = buffer.size() * sizeof(T);
+        Run run = {spill.reserve(bytes), buffer.size()};
+        spill.write(run.offset, reinterpret_cast<const char*>(buffer.data()), bytes);
+        runs.push_back(run);
+        buffer.clear();
+    }
+
+    // Merges the first count runs and releases them
+    template <class Visit>
+    void mergeRuns(size_t count, Visit visit) {
+        vector<RunReader> readers(count);
+        vector<T> heads(count);
+        // Top of the heap is the smallest head; ties go to the earlier run
+        auto after = [&](size_t a, size_t b) {
+            return less(heads[b], heads[a]) || (!less(heads[a], heads[b]) && a > b);
+        };
+        vector<size_t> heap;
+        for (size_t i = 0; i < count; i++) {
+            readers[i] = {runs[i], 0, vector<char>(SORT_BLOCK_BYTES - SORT_BLOCK_BYTES % sizeof(T)),
+                          0, 0};
+            if (read(readers[i], heads[i])) heap.push_back(i);
+        }
+        make_heap(heap.begin(), heap.end(), after);
+        while (!heap.empty()) {
+            pop_heap(heap.begin(), heap.end(), after);
+            size_t run = heap.back();
+            visit(heads[run]);
+            if (read(readers[run], heads[run])) {
+                push_heap(heap.begin(), heap.end(), after);
+            } else {
+                heap.pop_back();
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            spill.release(runs.front().offset, runs.front().records * sizeof(T));
+            runs.pop_front();
+        }
+    }
+
+    bool read(RunReader& reader, T& record) {
+        if (reader.pos == reader.filled) {
+            uint64_t left = (reader.run.records - reader.consumed) * sizeof(T);
+            if (left == 0) return false;
+            reader.filled = (size_t)min<uint64_t>(left, reader.block.size());
+            spill.read(reader.run.offset + reader.consumed * sizeof(T), reader.block.data(),
+                       reader.filled);
+            reader.consumed += reader.filled / sizeof(T);
+            reader.pos = 0;
+        }
+        memcpy(&record, &reader.block[reader.pos], sizeof(T));
+        reader.pos += sizeof(T);
+        return true;
+    }
+};
+
+// ==================== Show cache ====================
+//
+// Filtered show output is kept fully rendered, so a repeated query costs a
+// hash lookup and one write. Every entry remembers the versions it was
+// built from: the version of each index it consulted and the version of
+// each of its rows. Writers bump those counters, which makes stale entries
+// fail validation on their next lookup instead of being hunted down.
+//
+// Book versions live in a fixed array indexed by a hash of the ISBN; books
+// sharing a slot only cost each other spurious misses.
+
+// DEP_STOCK changes whenever a book runs out of stock or is restocked from zero
+enum ShowDependency {
+    DEP_CATALOG,
+    DEP_NAME,
+    DEP_AUTHOR,
+    DEP_KEYWORD,
+    DEP_GRAM,
+    DEP_PRICE,
+    DEP_STOCK,
+    DEP_COUNT
+};
+
+const size_t BOOK_VERSION_SLOTS = 4096;
+const size_t SHOW_CACHE_BYTES = 4 << 20;
+const size_t SHOW_CACHE_ENTRY_BYTES = SHOW_CACHE_BYTES / 8;
+
+atomic<uint64_t> bookVersions[BOOK_VERSION_SLOTS];
+atomic<uint64_t> indexVersions[DEP_COUNT];
+
+uint32_t bookVersionSlot(const char* isbn) {
+    uint32_t hash = 2166136261u;
+    for (; *isbn; isbn++) hash = (hash ^ (unsigned char)*isbn) * 16777619u;
+    return hash % BOOK_VERSION_SLOTS;
+}
+
+void bumpBookVersion(const char* isbn) {
+    bookVersions[bookVersionSlot(isbn)].fetch_add(1, memory_order_release);
+}
+
+void bumpIndexVersion(ShowDependency dependency) {
+    indexVersions[dependency].fetch_add(1, memory_order_release);
+}
+
+struct IndexVersions {
+    uint64_t value[DEP_COUNT];
+
+    static IndexVersions current() {
+        IndexVersions v;
+        for (int i = 0; i < DEP_COUNT; i++) v.value[i] = indexVersions[i].load(memory_order_acquire);
+        return v;
+    }
+};
+
+// A book's show line, formatted once per version. Direct-mapped on the
+// same slots as the version counters.
+class RowCache {
+public:
+    RowCache() : rows(BOOK_VERSION_SLOTS) {}
+
+    const string& render(const Book& book) {
+        uint32_t slot = bookVersionSlot(book.ISBN);
+        uint64_t version = bookVersions[slot].load(memory_order_acquire);
+        Row& row = rows[slot];
+        if (row.filled && row.version == version && strcmp(row.isbn, book.ISBN) == 0) {
+            return row.text;
+        }
+        char price[32];
+        snprintf(price, sizeof(price), "%.2f", book.price);
+        row.text.clear();
+        row.text.append(book.ISBN).append("\t").append(book.bookName).append("\t");
+        row.text.append(book.author).append("\t").append(book.keyword).append("\t");
+        row.text.append(price).append("\t").append(to_string(book.quantity)).append("\n");
+        strcpy(row.isbn, book.ISBN);
+        row.version = version;
+        row.filled = true;
+        return row.text;
+    }
+
+private:
+    struct Row {
+        bool filled = false;
+        char isbn[21];
+        uint64_t version;
+        string text;
+    };
+    vector<Row> rows;
+};
+
+struct ShowCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t stale = 0;
+};
+
+// Rendered results keyed by the normalized filter, evicted least recently
+// used first once SHOW_CACHE_BYTES is exceeded. Used from the command
+// thread only.
+class ShowCache {
+public:
+    // Writes the cached output for key and returns true if it is still valid
+    bool serve(const string& key, ostream& out) {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            stats.misses++;
+            return false;
+        }
+        Entry& entry = *it->second;
+        if (!isCurrent(entry)) {
+            stats.stale++;
+            drop(it->second);
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        out.write(entry.output.data(), entry.output.size());
+        stats.hits++;
+        return true;
+    }
+
+    // Versions of the rows an entry was rendered from, by version slot
+    typedef vector<pair<uint32_t, uint64_t>> RowVersions;
+
+    // Remembers output rendered from rows. versions must have been taken
+    // before the indexes named in dependencies were read.
+    void store(const string& key, uint32_t dependencies, const IndexVersions& versions,
+               RowVersions rows, string output) {
+        if (output.size() > SHOW_CACHE_ENTRY_BYTES) return;
+        auto it = entries.find(key);
+        if (it != entries.end()) drop(it->second);
+
+        Entry entry;
+        entry.key = key;
+        entry.dependencies = dependencies;
+        entry.versions = versions;
+        entry.rows = move(rows);
+        entry.output = move(output);
+        bytes += entry.footprint();
+        lru.push_front(move(entry));
+        entries[key] = lru.begin();
+
+        while (bytes > SHOW_CACHE_BYTES) drop(prev(lru.end()));
+    }
+
+    size_t size() const { return entries.size(); }
+    size_t memory() const { return bytes; }
+    const ShowCacheStats& statistics() const { return stats; }
+
+private:
+    struct Entry {
+        string key;
+        uint32_t dependencies;
+        IndexVersions versions;
+        RowVersions rows;
+        string output;
+
+        size_t footprint() const {
+            return key.size() + output.size() + rows.size() * sizeof(rows[0]) + sizeof(Entry);
+        }
+    };
+
+    list<Entry> lru;
+    unordered_map<string, list<Entry>::iterator> entries;
+    size_t bytes = 0;
+    ShowCacheStats stats;
+
+    static bool isCurrent(const Entry& entry) {
+        for (int i = 0; i < DEP_COUNT; i++) {
+            if ((entry.dependencies >> i & 1) &&
+                indexVersions[i].load(memory_order_acquire) != entry.versions.value[i]) {
+                return false;
+            }
+        }
+        for (const auto& row : entry.rows) {
+            if (bookVersions[row.first].load(memory_order_acquire) != row.second) return false;
+        }
+        return true;
+    }
+
+    void drop(list<Entry>::iterator it) {
+        bytes -= it->footprint();
+        entries.erase(it->key);
+        lru.erase(it);
+    }
+};
+
+// Starting state of the rows an export in progress has not written yet.
+// The export walks its tree in key order over several steps; before a row
+// past its cursor first changes, the row's state at the start (or its
+// absence) is pinned here, and the export writes the pin instead of the
+// live row. Memory grows only with the rows changed ahead of the cursor.
+// Used from the command thread only.
+template <class Value>
+class SnapshotPins {
+public:
+    struct Pin {
+        bool present;
+        Value value;
+    };
+
+    string cursor;  // key of the last row written
+    map<string, Pin> pins;
+
+    void start() {
+        active = true;
+        cursor.clear();
+        pins.clear();
+    }
+
+    void stop() {
+        active = false;
+        map<string, Pin>().swap(pins);
+    }
+
+    // Called before the row under key changes; find(value) reads its
+    // current state and returns whether it exists
+    template <class Find>
+    void pin(const char* key, Find find) {
+        if (!active || strcmp(key, cursor.c_str()) <= 0 || pins.count(key) != 0) return;
+        Pin p;
+        p.present = find(p.value);
+        pins.emplace(key, p);
+    }
+
+private:
+    bool active = false;
+};
+
+// ==================== Global data structures ====================
+
+BPlusTree<UserKey, Account> accounts;
+Catalog books;
+TransactionLedger transactions;
+
+// Negative-lookup filters in front of the ISBN and userID trees
+BloomFilter isbnFilter;
+BloomFilter userFilter;
+
+// Secondary indexes, each entry is (field value, ISBN)
+BPlusTree<TextKey, char> nameIndex;
+BPlusTree<TextKey, char> authorIndex;
+BPlusTree<TextKey, char> keywordIndex;
+
+// N-gram index over bookName and author. Strings are padded with two anchor
+// characters so that prefixes of any length map to at least one gram.
+const char GRAM_ANCHOR = '\x01';
+const uint32_t GRAM_FIELD_NAME = 1;
+const uint32_t GRAM_FIELD_AUTHOR = 2;
+const size_t OVERLAP_BATCH = 64;  // gram entries read per descent by fuzzy lookups
+BPlusTree<GramKey, char> gramIndex;
+
+// Books ordered by price, each entry is (price, ISBN)
+BPlusTree<PriceKey, char> priceIndex;
+
+// Rendered show lines and results
+RowCache bookRows;
+ShowCache showCache;
+
+// Rows pinned for an export in progress
+SnapshotPins<Book> bookPins;
+SnapshotPins<Account> accountPins;
+
+// Login stack
+struct LoginSession {
+    string userID;
+    int privilege;
+    string selectedISBN;
+};
+vector<LoginSession> loginStack;
+
+// File paths
+const string ACCOUNT_FILE = "accounts.dat";
+const string BOOK_FILE_PREFIX = "books";
+const string TRANSACTION_FILE = "transactions.dat";
+const string SEGMENT_INDEX_FILE = "transactions_index.dat";
+const string LOG_FILE = "log.dat";
+const string NAME_INDEX_FILE = "index_name.dat";
+const string AUTHOR_INDEX_FILE = "index_author.dat";
+const string KEYWORD_INDEX_FILE = "index_keyword.dat";
+const string GRAM_INDEX_FILE = "index_gram.dat";
+const string PRICE_INDEX_FILE = "index_price.dat";
+const string ISBN_FILTER_FILE = "filter_isbn.dat";
+const string USER_FILTER_FILE = "filter_user.dat";
+const string JOURNAL_FILE = "journal.dat";
+
+// Scratch file for the sorted runs of bulk loading and index rebuilds; it
+// exists only while one of them runs, so a store never holds more than its
+// 15 files plus this one, within the 20-file limit
+const string SPILL_FILE = "bulk_spill.tmp";
+
+// Flat record arrays written by the first version of the program; migrated
+// into the paged store on startup
+const string BASELINE_BOOK_FILE = "books.dat";
+const string BASELINE_SUFFIX = ".baseline";
+
+// Helper functions
+void trim(string& s) {
+    s.erase(0, s.find_first_not_of(" \t\r\n"));
+    s.erase(s.find_last_not_of(" \t\r\n") + 1);
+}
+
+vector<string> split(const string& s, char delimiter) {
+    vector<string> tokens;
+    string token;
+    istringstream tokenStream(s);
+    while (getline(tokenStream, token, delimiter)) {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+bool isValidUserID(const string& s) {
+    if (s.empty() || s.length() > 30) return false;
+    for (char c : s) {
+        if (!isalnum(c) && c != '_') return false;
+    }
+    return true;
+}
+
+bool isValidPassword(const string& s) {
+    return isValidUserID(s);
+}
+
+bool isValidUsername(const string& s) {
+    if (s.empty() || s.length() > 30) return false;
+    for (char c : s) {
+        if (c < 32 || c > 126) return false;
+    }
+    return true;
+}
+
+bool isValidISBN(const string& s) {
+    if (s.empty() || s.length() > 20) return false;
+    for (char c : s) {
+        if (c < 33 || c > 126) return false;
+    }
+    return true;
+}
+
+bool isValidBookName(const string& s) {
+    if (s.empty() || s.length() > 60) return false;
+    for (char c : s) {
+        // ASCII characters except invisible characters (0-31, 127) and double quote (34)
+        if (c < 32 || c > 126 || c == '"') return false;
+    }
+    return true;
+}
+
+bool isValidKeyword(const string& s) {
+    if (s.empty() || s.length() > 60) return false;
+    for (char c : s) {
+        // ASCII characters except invisible characters (0-31, 127) and double quote (34)
+        if (c < 32 || c > 126 || c == '"') return false;
+    }
+    // Check for duplicate keywords
+    vector<string> keywords = split(s, '|');
+    set<string> uniqueKeywords(keywords.begin(), keywords.end());
+    if (keywords.size() != uniqueKeywords.size()) return false;
+    // Check each keyword is non-empty
+    for (const auto& kw : keywords) {
+        if (kw.empty()) return false;
+    }
+    return true;
+}
+
+bool isValidPrice(const string& s) {
+    if (s.empty() || s.length() > 13) return false;
+    int dotCount = 0;
+    for (char c : s) {
+        if (c == '.') {
+            dotCount++;
+            if (dotCount > 1) return false;
+        } else if (!isdigit(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool isValidQuantity(const string& s) {
+    if (s.empty() || s.length() > 10) return false;
+    for (char c : s) {
+        if (!isdigit(c)) return false;
+    }
+    long long val = stoll(s);
+    return val > 0 && val <= 2147483647;
+}
+
+uint32_t makeGram(uint32_t field, char a, char b, char c) {
+    return (field << 24) | ((uint32_t)(unsigned char)a << 16) |
+           ((uint32_t)(unsigned char)b << 8) | (uint32_t)(unsigned char)c;
+}
+
+// Grams of the anchored text; used both for indexing and prefix queries
+vector<uint32_t> anchoredGrams(uint32_t field, const string& text) {
+    vector<uint32_t> grams;
+    string padded = string(2, GRAM_ANCHOR) + text;
+    for (size_t i = 0; i + 3 <= padded.length(); i++) {
+        grams.push_back(makeGram(field, padded[i], padded[i + 1], padded[i + 2]));
+    }
+    return grams;
+}
+
+// Grams of the bare text; used for substring queries
+vector<uint32_t> plainGrams(uint32_t field, const string& text) {
+    vector<uint32_t> grams;
+    for (size_t i = 0; i + 3 <= text.length(); i++) {
+        grams.push_back(makeGram(field, text[i], text[i + 1], text[i + 2]));
+    }
+    return grams;
+}
+
+// The grams sorted, each once
+vector<uint32_t> distinctGrams(vector<uint32_t> grams) {
+    sort(grams.begin(), grams.end());
+    grams.erase(unique(grams.begin(), grams.end()), grams.end());
+    return grams;
+}
+
+// Calls text(index, key) for every name/author/keyword index entry of a
+// book and gram(key) for every gram index entry (grams may repeat)
+template <class TextVisit, class GramVisit>
+void forEachIndexEntry(const Book& book, TextVisit text, GramVisit gram) {
+    auto apply = [&](BPlusTree<TextKey, char>& index, const string& value) {
+        if (!value.empty()) text(index, TextKey(value.c_str(), book.ISBN));
+    };
+    apply(nameIndex, book.bookName);
+    apply(authorIndex, book.author);
+    for (const auto& kw : split(book.keyword, '|')) {
+        apply(keywordIndex, kw);
+    }
+
+    vector<uint32_t> grams = anchoredGrams(GRAM_FIELD_NAME, book.bookName);
+    vector<uint32_t> authorGrams = anchoredGrams(GRAM_FIELD_AUTHOR, book.author);
+    grams.insert(grams.end(), authorGrams.begin(), authorGrams.end());
+    for (uint32_t g : grams) {
+        gram(GramKey(g, book.ISBN));
+    }
+}
+
+ShowDependency dependencyOf(const BPlusTree<TextKey, char>& index) {
+    if (&index == &nameIndex) return DEP_NAME;
+    if (&index == &authorIndex) return DEP_AUTHOR;
+    return DEP_KEYWORD;
+}
+
+uint32_t gramField(const GramKey& key) {
+    return key.gram >> 24;
+}
+
+// Adds all secondary index entries of a book, including its price entry
+void indexBook(const Book& book) {
+    forEachIndexEntry(
+        book,
+        [&](BPlusTree<TextKey, char>& index, const TextKey& key) {
+            index.insert(key, 0);
+            bumpIndexVersion(dependencyOf(index));
+        },
+        [&](const GramKey& key) {
+            gramIndex.insert(key, 0);
+            bumpIndexVersion(DEP_GRAM);
+        });
+    priceIndex.insert(PriceKey(book.price, book.ISBN), 0);
+    bumpIndexVersion(DEP_PRICE);
+}
+
+// Moves the index entries of a modified book from its old to its new
+// values. Fields that did not change keep their entries (unless the ISBN
+// moved), so e.g. a price change only touches the price index.
+void reindexBook(const Book& before, const Book& after) {
+    bool moved = strcmp(before.ISBN, after.ISBN) != 0;
+    bool name = moved || strcmp(before.bookName, after.bookName) != 0;
+    bool author = moved || strcmp(before.author, after.author) != 0;
+    bool keyword = moved || strcmp(before.keyword, after.keyword) != 0;
+    auto textChanged = [&](BPlusTree<TextKey, char>& index) {
+        ShowDependency dependency = dependencyOf(index);
+        return dependency == DEP_NAME ? name : dependency == DEP_AUTHOR ? author : keyword;
+    };
+    auto gramChanged = [&](const GramKey& key) {
+        return gramField(key) == GRAM_FIELD_NAME ? name : author;
+    };
+
+    forEachIndexEntry(
+        before,
+        [&](BPlusTree<TextKey, char>& index, const TextKey& key) {
+            if (!textChanged(index)) return;
+            index.erase(key);
+            bumpIndexVersion(dependencyOf(index));
+        },
+        [&](const GramKey& key) {
+            if (!gramChanged(key)) return;
+            gramIndex.erase(key);
+            bumpIndexVersion(DEP_GRAM);
+        });
+    forEachIndexEntry(
+        after,
+        [&](BPlusTree<TextKey, char>& index, const TextKey& key) {
+            if (!textChanged(index)) return;
+            index.insert(key, 0);
+            bumpIndexVersion(dependencyOf(index));
+        },
+        [&](const GramKey& key) {
+            if (!gramChanged(key)) return;
+            gramIndex.insert(key, 0);
+            bumpIndexVersion(DEP_GRAM);
+        });
+
+    if (moved || before.price != after.price) {
+        priceIndex.erase(PriceKey(before.price, before.ISBN));
+        priceIndex.insert(PriceKey(after.price, after.ISBN), 0);
+        bumpIndexVersion(DEP_PRICE);
+    }
+}
+
+// A sorted list of ISBNs that show filters draw candidates from: the
+// entries of one value in a name/author/keyword index, the entries of one
+// gram in the gram index, the ISBNs found under at least a minimum number
+// of several grams, or a single ISBN
+struct PostingList {
+    enum Kind { TEXT, GRAM, OVERLAP, SINGLE };
+
+    Kind kind;
+    BPlusTree<TextKey, char>* index;
+    string text;  // the indexed value, or the ISBN of a SINGLE list
+    uint32_t gram;
+    vector<uint32_t> grams;  // of an OVERLAP list
+    size_t minimum = 0;
+
+    static PostingList ofText(BPlusTree<TextKey, char>& index, const string& text) {
+        return {TEXT, &index, text, 0};
+    }
+    static PostingList ofGram(uint32_t gram) { return {GRAM, nullptr, "", gram}; }
+    static PostingList ofOverlap(const vector<uint32_t>& grams, size_t minimum) {
+        return {OVERLAP, nullptr, "", 0, grams, minimum};
+    }
+    static PostingList ofIsbn(const string& isbn) { return {SINGLE, nullptr, isbn, 0}; }
+
+    // Finds the first ISBN >= isbn (> isbn if after is set). Each seek
+    // descends the index directly to the target, skipping everything before.
+    bool seek(const string& isbn, bool after, string& found) const {
+        if (kind == SINGLE) {
+            if (after ? text <= isbn : text < isbn) return false;
+            found = text;
+            return true;
+        }
+        bool hit = false;
+        walk(isbn, [&](const char* entry) {
+            if (after && isbn == entry) return true;
+            found = entry;
+            hit = true;
+            return false;
+        });
+        return hit;
+    }
+
+    // Length of the list, counting no further than limit
+    uint64_t count(uint64_t limit) const {
+        if (kind == SINGLE) return 1;
+        uint64_t n = 0;
+        walk("", [&](const char*) { return ++n < limit; });
+        return n;
+    }
+
+    // Calls visit(isbn) for every entry in order
+    template <class Visit>
+    void forEach(Visit visit) const {
+        if (kind == SINGLE) {
+            visit(text);
+            return;
+        }
+        walk("", [&](const char* entry) {
+            visit(string(entry));
+            return true;
+        });
+    }
+
+private:
+    // Feeds step(isbn) the entries from the first ISBN >= from while it
+    // returns true
+    template <class Step>
+    void walk(const string& from, Step step) const {
+        if (kind == TEXT) {
+            for (auto c = index->lowerBound(TextKey(text.c_str(), from.c_str()));
+                 c.valid() && text == c.key().text; c.next()) {
+                if (!step(c.key().isbn)) return;
+            }
+        } else if (kind == GRAM) {
+            for (auto c = gramIndex.lowerBound(GramKey(gram, from.c_str()));
+                 c.valid() && c.key().gram == gram; c.next()) {
+                if (!step(c.key().isbn)) return;
+            }
+        } else {
+            walkOverlap(from, step);
+        }
+    }
+
+    // Upcoming entries of one gram's list, read a batch at a time so that
+    // stepping along the list does not descend the tree for every entry
+    struct GramHead {
+        uint32_t gram;
+        vector<string> batch;
+        size_t next = 0;
+        bool ended = false;
+
+        bool valid() const { return next < batch.size(); }
+        const string& isbn() const { return batch[next]; }
+
+        // Moves to the first ISBN >= isbn (> isbn if after)
+        void seek(const string& isbn, bool after) {
+            next = partition_point(batch.begin() + next, batch.end(),
+                                   [&](const string& e) { return after ? e <= isbn : e < isbn; }) -
+                   batch.begin();
+            if (next < batch.size() || ended) return;
+            batch.clear();
+            next = 0;
+            for (auto c = gramIndex.lowerBound(GramKey(gram, isbn.c_str()));
+                 c.valid() && c.key().gram == gram; c.next()) {
+                if (after && isbn == c.key().isbn) continue;
+                if (batch.size() == OVERLAP_BATCH) return;
+                batch.push_back(c.key().isbn);
+            }
+            ended = true;
+        }
+    };
+
+    // Keeps the head (next ISBN) of every gram's list. Only the
+    // minimum-th smallest head can be the next ISBN under enough grams, so
+    // the lists behind it seek straight to it rather than being merged
+    // entry by entry; entries no candidate can reach are skipped.
+    template <class Step>
+    void walkOverlap(const string& from, Step step) const {
+        vector<GramHead> heads(grams.size());
+        for (size_t i = 0; i < grams.size(); i++) {
+            heads[i].gram = grams[i];
+            heads[i].seek(from, false);
+        }
+        vector<const string*> live;
+        while (true) {
+            live.clear();
+            for (const auto& head : heads) {
+                if (head.valid()) live.push_back(&head.isbn());
+            }
+            if (live.size() < minimum) return;
+            nth_element(live.begin(), live.begin() + (minimum - 1), live.end(),
+                        [](const string* a, const string* b) { return *a < *b; });
+            string candidate = *live[minimum - 1];
+            size_t hits = 0;
+            for (auto& head : heads) {
+                if (head.valid() && head.isbn() < candidate) head.seek(candidate, false);
+                if (head.valid() && head.isbn() == candidate) hits++;
+            }
+            if (hits < minimum) continue;
+            if (!step(candidate.c_str())) return;
+            for (auto& head : heads) {
+                if (head.valid() && head.isbn() == candidate) head.seek(candidate, true);
+            }
+        }
+    }
+};
+
+// Orders posting lists shortest first. The indexes keep no cardinality
+// statistics, so instead the lists are counted in rounds with a growing
+// limit until one of them ends; finding the most selective list costs
+// about as much as reading it.
+void planPostings(vector<PostingList>& lists) {
+    if (lists.size() < 2) return;
+    vector<pair<uint64_t, size_t>> sizes(lists.size());
+    for (uint64_t limit = 16;; limit *= 8) {
+        bool ended = false;
+        for (size_t i = 0; i < lists.size(); i++) {
+            sizes[i] = {lists[i].count(limit), i};
+            if (sizes[i].first < limit) ended = true;
+        }
+        if (ended) break;
+    }
+    stable_sort(sizes.begin(), sizes.end());
+    vector<PostingList> ordered;
+    for (const auto& s : sizes) ordered.push_back(lists[s.second]);
+    lists.swap(ordered);
+}
+
+// Calls visit(isbn) for every ISBN present in all of the lists, in ISBN
+// order. The lists are intersected by leapfrogging, starting from the most
+// selective one: each list seeks to the current candidate, so the work
+// follows the shortest list rather than the longest.
+template <class Visit>
+void intersectPostings(vector<PostingList> lists, Visit visit) {
+    if (lists.empty()) return;
+    if (lists.size() == 1) {
+        lists[0].forEach(visit);
+        return;
+    }
+    planPostings(lists);
+
+    size_t i = 0, agreed = 0;
+    string candidate, found;
+    while (lists[i].seek(candidate, agreed == lists.size(), found)) {
+        if (agreed > 0 && agreed < lists.size() && found == candidate) {
+            agreed++;
+        } else {
+            candidate = found;
+            agreed = 1;
+        }
+        // After a match the same list moves on past the candidate
+        if (agreed == lists.size()) {
+            visit(candidate);
+        } else {
+            i = (i + 1) % lists.size();
+        }
+    }
+}
+
+int getCurrentPrivilege() {
+    if (loginStack.empty()) return 0;
+    return loginStack.back().privilege;
+}
+
+string getCurrentUserID() {
+    if (loginStack.empty()) return "";
+    return loginStack.back().userID;
+}
 
-// Login stack
-struct LoginSession {
-    string userID;
-    string selectedISBN;
+// Refills a filter from every key in its tree (or catalog)
+template <class Tree>
+void rebuildFilter(BloomFilter& filter, Tree& tree) {
+    filter.reset(tree.size());
+    for (auto c = tree.begin(); c.valid(); c.next()) filter.add(c.key().value);
+}
+
+struct KeyLess {
+    template <class Key>
+    bool operator()(const Key& a, const Key& b) const { return compareKey(a, b) < 0; }
 };
-vector<LoginSession> loginStack;
 
-// File paths
-const string ACCOUNT_FILE = "accounts.dat";
-const string BOOK_FILE = "books.dat";
-const string TRANSACTION_FILE = "transactions.dat";
-const string LOG_FILE = "log.dat";
+// Collects the secondary index entries of a stream of books, then writes
+// every secondary index bottom-up. The entries are sorted externally, with
+// the memory budget split between the five indexes.
+class IndexBuild {
+public:
+    IndexBuild(SpillFile& spill, size_t memoryBytes)
+        : names(spill, memoryBytes / 5, KeyLess()),
+          authors(spill, memoryBytes / 5, KeyLess()),
+          keywords(spill, memoryBytes / 5, KeyLess()),
+          grams(spill, memoryBytes / 5, KeyLess()),
+          prices(spill, memoryBytes / 5, KeyLess()) {}
+
+    void add(const Book& book) {
+        forEachIndexEntry(
+            book,
+            [&](BPlusTree<TextKey, char>& index, const TextKey& key) {
+                TextSorter& sorter =
+                    &index == &nameIndex ? names : &index == &authorIndex ? authors : keywords;
+                sorter.add(key);
+            },
+            [&](const GramKey& key) { grams.add(key); });
+        prices.add(PriceKey(book.price, book.ISBN));
+    }
 
-// Helper functions
-void trim(string& s) {
-    s.erase(0, s.find_first_not_of(" \t\r\n"));
-    s.erase(s.find_last_not_of(" \t\r\n") + 1);
-}
+    void finish() {
+        build(names, nameIndex);
+        build(authors, authorIndex);
+        build(keywords, keywordIndex);
+        build(grams, gramIndex);
+        build(prices, priceIndex);
+    }
 
-vector<string> split(const string& s, char delimiter) {
-    vector<string> tokens;
-    string token;
-    istringstream tokenStream(s);
-    while (getline(tokenStream, token, delimiter)) {
-        tokens.push_back(token);
+private:
+    typedef ExternalSorter<TextKey, KeyLess> TextSorter;
+    TextSorter names;
+    TextSorter authors;
+    TextSorter keywords;
+    ExternalSorter<GramKey, KeyLess> grams;
+    ExternalSorter<PriceKey, KeyLess> prices;
+
+    template <class Sorter, class Tree>
+    static void build(Sorter& sorter, Tree& tree) {
+        typename Tree::Builder builder(&tree);
+        sorter.merge([&](const auto& key) { builder.append(key, 0); });
+        builder.finish();
     }
-    return tokens;
+};
+
+// Rebuilds every secondary index from the catalog
+void rebuildIndexes() {
+    SpillFile spill(SPILL_FILE);
+    IndexBuild indexes(spill, bufferPool.capacity());
+    for (auto c = books.begin(); c.valid(); c.next()) indexes.add(c.value());
+    indexes.finish();
 }
 
-bool isValidUserID(const string& s) {
-    if (s.empty() || s.length() > 30) return false;
-    for (char c : s) {
-        if (!isalnum(c) && c != '_') return false;
-    }
-    return true;
+// Account and book lookups go through the filters, so most misses never
+// reach the trees; inserts and erases keep the filters current
+bool findAccount(const string& userID, Account* account = nullptr) {
+    if (!userFilter.mayContain(userID.c_str())) return false;
+    if (accounts.find(UserKey(userID.c_str()), account)) return true;
+    userFilter.noteFalsePositive();
+    return false;
 }
 
-bool isValidPassword(const string& s) {
-    return isValidUserID(s);
+// An export in progress keeps the state of the rows it has not reached
+void pinAccount(const char* userID) {
+    accountPins.pin(userID, [&](Account& account) { return accounts.find(UserKey(userID), &account); });
 }
 
-bool isValidUsername(const string& s) {
-    if (s.empty() || s.length() > 30) return false;
-    for (char c : s) {
-        if (c < 32 || c > 126) return false;
-    }
-    return true;
+void pinBook(const char* isbn) {
+    bookPins.pin(isbn, [&](Book& book) { return books.find(IsbnKey(isbn), &book); });
 }
 
-bool isValidISBN(const string& s) {
-    if (s.empty() || s.length() > 20) return false;
-    for (char c : s) {
-        if (c < 33 || c > 126) return false;
-    }
-    return true;
+void insertAccount(const Account& account) {
+    pinAccount(account.userID);
+    accounts.insert(UserKey(account.userID), account);
+    userFilter.add(account.userID);
+    if (userFilter.needsRebuild()) rebuildFilter(userFilter, accounts);
 }
 
-bool isValidBookName(const string& s) {
-    if (s.empty() || s.length() > 60) return false;
-    for (char c : s) {
-        // ASCII characters except invisible characters (0-31, 127) and double quote (34)
-        if (c < 32 || c > 126 || c == '"') return false;
-    }
-    return true;
+void eraseAccount(const string& userID) {
+    pinAccount(userID.c_str());
+    accounts.erase(UserKey(userID.c_str()));
+    userFilter.remove();
+    if (userFilter.needsRebuild()) rebuildFilter(userFilter, accounts);
 }
 
-bool isValidKeyword(const string& s) {
-    if (s.empty() || s.length() > 60) return false;
-    for (char c : s) {
-        // ASCII characters except invisible characters (0-31, 127) and double quote (34)
-        if (c < 32 || c > 126 || c == '"') return false;
-    }
-    // Check for duplicate keywords
-    vector<string> keywords = split(s, '|');
-    set<string> uniqueKeywords(keywords.begin(), keywords.end());
-    if (keywords.size() != uniqueKeywords.size()) return false;
-    // Check each keyword is non-empty
-    for (const auto& kw : keywords) {
-        if (kw.empty()) return false;
-    }
+bool findBook(const string& isbn, Book* book = nullptr) {
+    if (!isbnFilter.mayContain(isbn.c_str())) return false;
+    if (books.find(IsbnKey(isbn.c_str()), book)) return true;
+    isbnFilter.noteFalsePositive();
+    return false;
+}
+
+void insertBook(const Book& book) {
+    pinBook(book.ISBN);
+    books.insert(IsbnKey(book.ISBN), book);
+    bumpBookVersion(book.ISBN);
+    bumpIndexVersion(DEP_CATALOG);
+    isbnFilter.add(book.ISBN);
+    if (isbnFilter.needsRebuild()) rebuildFilter(isbnFilter, books);
+}
+
+void eraseBook(const string& isbn) {
+    pinBook(isbn.c_str());
+    books.erase(IsbnKey(isbn.c_str()));
+    bumpBookVersion(isbn.c_str());
+    bumpIndexVersion(DEP_CATALOG);
+    isbnFilter.remove();
+    if (isbnFilter.needsRebuild()) rebuildFilter(isbnFilter, books);
+}
+
+void recordTransaction(double amount, bool isIncome, const string& isbn) {
+    Transaction trans;
+    trans.amount = amount;
+    trans.isIncome = isIncome;
+    trans.timestamp = time(nullptr);
+    transactions.push_back(trans, Catalog::shardOf(isbn.c_str()));
+}
+
+// Stock changes behind buy and import. The book is read and written under
+// its shard lock, so both are safe to call from several threads.
+bool purchaseBook(const string& isbn, int quantity, double& totalCost) {
+    if (!isbnFilter.mayContain(isbn.c_str())) return false;
+    bool soldOut = false;
+    pinBook(isbn.c_str());
+    bool bought = books.modify(IsbnKey(isbn.c_str()), [&](Book& book) {
+        if (book.quantity < quantity) return false;
+        totalCost = book.price * quantity;
+        if (!fitsLedger(totalCost)) return false;
+        book.quantity -= quantity;
+        soldOut = book.quantity == 0;
+        return true;
+    });
+    if (!bought) return false;
+    bumpBookVersion(isbn.c_str());
+    if (soldOut) bumpIndexVersion(DEP_STOCK);
+    recordTransaction(totalCost, true, isbn);
     return true;
 }
 
-bool isValidPrice(const string& s) {
-    if (s.empty() || s.length() > 13) return false;
-    int dotCount = 0;
-    for (char c : s) {
-        if (c == '.') {
-            dotCount++;
-            if (dotCount > 1) return false;
-        } else if (!isdigit(c)) {
-            return false;
-        }
-    }
+bool restockBook(const string& isbn, int quantity, double totalCost) {
+    if (!fitsLedger(totalCost)) return false;
+    bool wasEmpty = false;
+    pinBook(isbn.c_str());
+    bool stocked = books.modify(IsbnKey(isbn.c_str()), [&](Book& book) {
+        wasEmpty = book.quantity == 0;
+        book.quantity += quantity;
+        return true;
+    });
+    if (!stocked) return false;
+    bumpBookVersion(isbn.c_str());
+    if (wasEmpty) bumpIndexVersion(DEP_STOCK);
+    recordTransaction(totalCost, false, isbn);
     return true;
 }
 
-bool isValidQuantity(const string& s) {
-    if (s.empty() || s.length() > 10) return false;
-    for (char c : s) {
-        if (!isdigit(c)) return false;
+// Every file of the store
+vector<string> storeFiles() {
+    vector<string> files = {
+        ACCOUNT_FILE,      TRANSACTION_FILE,  SEGMENT_INDEX_FILE, NAME_INDEX_FILE,
+        AUTHOR_INDEX_FILE, KEYWORD_INDEX_FILE, GRAM_INDEX_FILE,   PRICE_INDEX_FILE,
+        ISBN_FILTER_FILE,  USER_FILTER_FILE,   JOURNAL_FILE,
+    };
+    for (int i = 0; i < CATALOG_SHARDS; i++) {
+        files.push_back(Catalog::shardFile(BOOK_FILE_PREFIX, i));
     }
-    long long val = stoll(s);
-    return val > 0 && val <= 2147483647;
+    return files;
 }
 
-int getCurrentPrivilege() {
-    if (loginStack.empty()) return 0;
-    return accounts[loginStack.back().userID].privilege;
+// The baseline layout: no header, records back to back
+struct BaselineTransaction {
+    double amount;
+    bool isIncome;
+};
+
+bool fileExists(const string& path) {
+    return access(path.c_str(), F_OK) == 0;
 }
 
-string getCurrentUserID() {
-    if (loginStack.empty()) return "";
-    return loginStack.back().userID;
+// Sets baseline files aside as *.baseline before a fresh store is created in
+// their place. A file is only taken if it lacks the store stamp and no
+// catalog shard exists yet, so a store of this format is never touched.
+// Returns true while set-aside files are waiting to be replayed; the store
+// files are then cleared, which also discards a migration cut short.
+bool prepareBaselineMigration() {
+    bool pending = false;
+    bool baseline = !fileExists(Catalog::shardFile(BOOK_FILE_PREFIX, 0));
+    for (const auto& file : {ACCOUNT_FILE, BASELINE_BOOK_FILE, TRANSACTION_FILE}) {
+        string saved = file + BASELINE_SUFFIX;
+        if (baseline && fileExists(file) && !fileExists(saved) && !hasStoreFormat(file)) {
+            if (rename(file.c_str(), saved.c_str()) != 0) {
+                throw runtime_error("cannot set aside " + file);
+            }
+        }
+        if (fileExists(saved)) pending = true;
+    }
+    if (!pending) return false;
+    for (const auto& file : storeFiles()) unlink(file.c_str());
+    return true;
+}
+
+// Reads a set-aside baseline file as an array of records; a missing file is
+// empty
+template <class T>
+vector<T> readBaselineFile(const string& file) {
+    string path = file + BASELINE_SUFFIX;
+    vector<T> records;
+    ifstream in(path, ios::binary);
+    if (!in) return records;
+    in.seekg(0, ios::end);
+    streamoff bytes = in.tellg();
+    if (bytes % sizeof(T) != 0) throw runtime_error(path + ": not a baseline store file");
+    records.resize(bytes / sizeof(T));
+    in.seekg(0);
+    in.read(reinterpret_cast<char*>(records.data()), bytes);
+    return records;
 }
 
-void loadData() {
-    // Load accounts
-    ifstream accountFile(ACCOUNT_FILE, ios::binary);
-    if (accountFile.is_open()) {
-        Account acc;
-        while (accountFile.read((char*)&acc, sizeof(Account))) {
-            accounts[acc.userID] = acc;
+// Replays the set-aside baseline files into the freshly opened store. The
+// baseline did not record times, so its transactions are dated 1970.
+void migrateBaselineStore() {
+    for (const Account& account : readBaselineFile<Account>(ACCOUNT_FILE)) {
+        if (memchr(account.userID, 0, sizeof(account.userID)) == nullptr ||
+            memchr(account.password, 0, sizeof(account.password)) == nullptr ||
+            memchr(account.username, 0, sizeof(account.username)) == nullptr) {
+            throw runtime_error(ACCOUNT_FILE + BASELINE_SUFFIX + ": not a baseline store file");
         }
-        accountFile.close();
+        insertAccount(account);
     }
-    
-    // Load books
-    ifstream bookFile(BOOK_FILE, ios::binary);
-    if (bookFile.is_open()) {
-        Book book;
-        while (bookFile.read((char*)&book, sizeof(Book))) {
-            books[book.ISBN] = book;
+    for (const Book& book : readBaselineFile<Book>(BASELINE_BOOK_FILE)) {
+        if (memchr(book.ISBN, 0, sizeof(book.ISBN)) == nullptr ||
+            memchr(book.bookName, 0, sizeof(book.bookName)) == nullptr ||
+            memchr(book.author, 0, sizeof(book.author)) == nullptr ||
+            memchr(book.keyword, 0, sizeof(book.keyword)) == nullptr) {
+            throw runtime_error(BASELINE_BOOK_FILE + BASELINE_SUFFIX + ": not a baseline store file");
         }
-        bookFile.close();
+        insertBook(book);
+        indexBook(book);
     }
-    
-    // Load transactions
-    ifstream transFile(TRANSACTION_FILE, ios::binary);
-    if (transFile.is_open()) {
-        Transaction trans;
-        while (transFile.read((char*)&trans, sizeof(Transaction))) {
-            transactions.push_back(trans);
+    for (const BaselineTransaction& record : readBaselineFile<BaselineTransaction>(TRANSACTION_FILE)) {
+        if (!fitsLedger(record.amount)) {
+            throw runtime_error(TRANSACTION_FILE + BASELINE_SUFFIX + ": amount out of range");
         }
-        transFile.close();
+        Transaction trans;
+        trans.amount = record.amount;
+        trans.isIncome = record.isIncome;
+        trans.timestamp = 0;
+        transactions.push_back(trans);
     }
-}
-
-void saveAccounts() {
-    ofstream accountFile(ACCOUNT_FILE, ios::binary | ios::trunc);
-    for (const auto& pair : accounts) {
-        accountFile.write((const char*)&pair.second, sizeof(Account));
+    bufferPool.flushAll();
+    for (const auto& file : {ACCOUNT_FILE, BASELINE_BOOK_FILE, TRANSACTION_FILE}) {
+        unlink((file + BASELINE_SUFFIX).c_str());
     }
-    accountFile.close();
 }
 
-void saveBooks() {
-    ofstream bookFile(BOOK_FILE, ios::binary | ios::trunc);
-    for (const auto& pair : books) {
-        bookFile.write((const char*)&pair.second, sizeof(Book));
+// Opens the store, migrating a baseline one first. Files of an unknown
+// format make it throw runtime_error.
+void initialize() {
+    bool migrating = prepareBaselineMigration();
+    bool interrupted = pageJournal.open(JOURNAL_FILE);
+    accounts.open(ACCOUNT_FILE);
+    books.open(BOOK_FILE_PREFIX);
+    transactions.open(TRANSACTION_FILE, SEGMENT_INDEX_FILE);
+    nameIndex.open(NAME_INDEX_FILE);
+    authorIndex.open(AUTHOR_INDEX_FILE);
+    keywordIndex.open(KEYWORD_INDEX_FILE);
+    gramIndex.open(GRAM_INDEX_FILE);
+    priceIndex.open(PRICE_INDEX_FILE);
+    isbnFilter.open(ISBN_FILTER_FILE);
+    userFilter.open(USER_FILTER_FILE);
+    if (migrating) migrateBaselineStore();
+
+    // A filter that is missing or out of step with its tree is rebuilt. After
+    // a command that was interrupted with stolen pages on disk, everything
+    // derived from the catalog is.
+    if (interrupted || isbnFilter.needsRebuild() || isbnFilter.keys() != books.size()) {
+        rebuildFilter(isbnFilter, books);
     }
-    bookFile.close();
-}
-
-void saveTransactions() {
-    ofstream transFile(TRANSACTION_FILE, ios::binary | ios::trunc);
-    for (const auto& trans : transactions) {
-        transFile.write((const char*)&trans, sizeof(Transaction));
+    if (interrupted || userFilter.needsRebuild() || userFilter.keys() != accounts.size()) {
+        rebuildFilter(userFilter, accounts);
     }
-    transFile.close();
-}
+    if (interrupted || priceIndex.size() != books.size()) rebuildIndexes();
 
-void initialize() {
-    loadData();
-    
     // Create root account if it doesn't exist
-    if (accounts.find("root") == accounts.end()) {
+    if (!findAccount("root")) {
         Account root;
         strcpy(root.userID, "root");
         strcpy(root.password, "sjtu");
         strcpy(root.username, "root");
         root.privilege = 7;
-        accounts["root"] = root;
-        saveAccounts();
+        insertAccount(root);
+    }
+    bufferPool.checkpoint();
+}
+
+// Every B+ tree with its file name
+vector<pair<string, TreeStructure*>> storageTrees() {
+    vector<pair<string, TreeStructure*>> trees = {{ACCOUNT_FILE, &accounts}};
+    for (int i = 0; i < CATALOG_SHARDS; i++) {
+        trees.push_back({Catalog::shardFile(BOOK_FILE_PREFIX, i), &books.shard(i)});
+    }
+    trees.insert(trees.end(), {
+        {NAME_INDEX_FILE, &nameIndex},     {AUTHOR_INDEX_FILE, &authorIndex},
+        {KEYWORD_INDEX_FILE, &keywordIndex}, {GRAM_INDEX_FILE, &gramIndex},
+        {PRICE_INDEX_FILE, &priceIndex},
+    });
+    return trees;
+}
+
+// Compaction rounds run so far, by what triggered them
+struct CompactionStats {
+    uint64_t idleRounds = 0;
+    uint64_t budgetRounds = 0;
+};
+CompactionStats compactionStats;
+
+// Runs one bounded compaction step over every tree; returns true while any
+// pass is still running
+bool compactRound() {
+    bool running = false;
+    for (const auto& tree : storageTrees()) {
+        if (tree.second->compactStep(COMPACTION_STEP_PAGES)) running = true;
+    }
+    return running;
+}
+
+// Called after every command; runs a compaction round once every
+// COMPACTION_INTERVAL commands whether or not more input is waiting
+void compactOnBudget() {
+    static int commands = 0;
+    if (++commands < COMPACTION_INTERVAL) return;
+    commands = 0;
+    compactRound();
+    compactionStats.budgetRounds++;
+}
+
+// True if path names one of the store's files, under whatever name
+bool isStoreFile(const string& path) {
+    struct stat target;
+    if (stat(path.c_str(), &target) != 0) return false;
+    for (const auto& file : storeFiles()) {
+        struct stat st;
+        if (stat(file.c_str(), &st) == 0 && st.st_dev == target.st_dev && st.st_ino == target.st_ino) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes all dirty pages back and fsyncs the store before exit
+void shutdown() {
+    bufferPool.flushAll();
+}
+
+// Moves every session's selection of a renamed book to its new ISBN. The
+// baseline only moved the current session's; an outer session then found
+// nothing under the old key once the catalog stopped conjuring blank books
+// on lookup, and its next modify or import acted on an empty record.
+void followRenamedBook(const string& oldISBN, const string& newISBN) {
+    for (auto& session : loginStack) {
+        if (session.selectedISBN == oldISBN) session.selectedISBN = newISBN;
     }
 }
 
@@ -260,13 +4057,12 @@ void cmdSu(const vector<string>& params) {
         return;
     }
     
-    if (accounts.find(userID) == accounts.end()) {
+    Account acc;
+    if (!findAccount(userID, &acc)) {
         cout << "Invalid\n";
         return;
     }
     
-    Account& acc = accounts[userID];
-    
     // Check password requirement
     if (getCurrentPrivilege() <= acc.privilege) {
         if (params.size() != 2 || password != acc.password) {
@@ -277,6 +4073,7 @@ void cmdSu(const vector<string>& params) {
     
     LoginSession session;
     session.userID = userID;
+    session.privilege = acc.privilege;
     loginStack.push_back(session);
 }
 
@@ -304,7 +4101,7 @@ void cmdRegister(const vector<string>& params) {
         return;
     }
 
-    if (accounts.find(userID) != accounts.end()) {
+    if (findAccount(userID)) {
         cout << "Invalid\n";
         return;
     }
@@ -314,8 +4111,7 @@ void cmdRegister(const vector<string>& params) {
     strcpy(acc.password, password.c_str());
     strcpy(acc.username, username.c_str());
     acc.privilege = 1;
-    accounts[userID] = acc;
-    saveAccounts();
+    insertAccount(acc);
 }
 
 void cmdPasswd(const vector<string>& params) {
@@ -343,13 +4139,12 @@ void cmdPasswd(const vector<string>& params) {
         return;
     }
 
-    if (accounts.find(userID) == accounts.end()) {
+    Account acc;
+    if (!findAccount(userID, &acc)) {
         cout << "Invalid\n";
         return;
     }
 
-    Account& acc = accounts[userID];
-
     if (getCurrentPrivilege() != 7) {
         if (params.size() != 3 || currentPassword != acc.password) {
             cout << "Invalid\n";
@@ -358,7 +4153,7 @@ void cmdPasswd(const vector<string>& params) {
     }
 
     strcpy(acc.password, newPassword.c_str());
-    saveAccounts();
+    accounts.update(UserKey(userID.c_str()), acc);
 }
 
 void cmdUseradd(const vector<string>& params) {
@@ -398,7 +4193,7 @@ void cmdUseradd(const vector<string>& params) {
         return;
     }
 
-    if (accounts.find(userID) != accounts.end()) {
+    if (findAccount(userID)) {
         cout << "Invalid\n";
         return;
     }
@@ -408,8 +4203,7 @@ void cmdUseradd(const vector<string>& params) {
     strcpy(acc.password, password.c_str());
     strcpy(acc.username, username.c_str());
     acc.privilege = privilege;
-    accounts[userID] = acc;
-    saveAccounts();
+    insertAccount(acc);
 }
 
 void cmdDelete(const vector<string>& params) {
@@ -430,7 +4224,7 @@ void cmdDelete(const vector<string>& params) {
         return;
     }
 
-    if (accounts.find(userID) == accounts.end()) {
+    if (!findAccount(userID)) {
         cout << "Invalid\n";
         return;
     }
@@ -443,109 +4237,447 @@ void cmdDelete(const vector<string>& params) {
         }
     }
 
-    accounts.erase(userID);
-    saveAccounts();
+    eraseAccount(userID);
 }
 
-void cmdShow(const vector<string>& params) {
-    if (getCurrentPrivilege() < 1) {
-        cout << "Invalid\n";
+void printBook(const Book& book) {
+    const string& row = bookRows.render(book);
+    cout.write(row.data(), row.size());
+}
+
+// Minimum trigram similarity of a fuzzy match: grams shared by the query
+// and the text over grams in either, in percent
+const int FUZZY_SIMILARITY_PERCENT = 30;
+
+// One filter of a show query. Candidates are the books found in all of
+// its posting lists (a substring too short to have grams contributes
+// none); prefix, substring and fuzzy filters then check the candidates
+// exactly.
+struct ShowFilter {
+    enum Check { CHECK_NONE, CHECK_PREFIX, CHECK_CONTAINS, CHECK_SIMILAR };
+
+    string option;
+    ShowDependency dependency;
+    vector<PostingList> postings;
+    Check check = CHECK_NONE;
+    uint32_t field = 0;
+    string value;
+    vector<uint32_t> grams;  // distinct grams of a fuzzy value, sorted
+
+    bool accepts(const Book& book) const {
+        if (check == CHECK_NONE) return true;
+        const char* text = field == GRAM_FIELD_NAME ? book.bookName : book.author;
+        if (check == CHECK_PREFIX) return strncmp(text, value.c_str(), value.length()) == 0;
+        if (check == CHECK_CONTAINS) return strstr(text, value.c_str()) != nullptr;
+        vector<uint32_t> own = distinctGrams(anchoredGrams(field, text));
+        size_t shared = 0;
+        for (size_t i = 0, j = 0; i < grams.size() && j < own.size();) {
+            if (grams[i] < own[j]) {
+                i++;
+            } else if (own[j] < grams[i]) {
+                j++;
+            } else {
+                shared++;
+                i++;
+                j++;
+            }
+        }
+        return 100 * shared >= FUZZY_SIMILARITY_PERCENT * (grams.size() + own.size() - shared);
+    }
+
+    // Checks a book that did not come out of the posting intersection. The
+    // grams of a checked filter follow from the check itself; other lists
+    // are probed with one seek each.
+    bool matches(const Book& book) const {
+        if (check == CHECK_NONE) {
+            string found;
+            for (const auto& list : postings) {
+                if (!list.seek(book.ISBN, false, found) || found != book.ISBN) return false;
+            }
+        }
+        return accepts(book);
+    }
+};
+
+// Parses one show filter:
+//   -ISBN=...  -name="..."  -author="..."  -keyword="..."
+//   -name-prefix="..."   -author-prefix="..."
+//   -name-contains="..." -author-contains="..."
+//   -name-fuzzy="..."    -author-fuzzy="..."
+// Prefix, substring and fuzzy filters go through the n-gram index. A fuzzy
+// filter matches texts whose anchored trigrams are at least
+// FUZZY_SIMILARITY_PERCENT similar to the value's; as similarity can only
+// reach that with enough grams shared, its candidates are the books listed
+// under that many of the value's grams. Returns false if the filter is
+// malformed.
+bool parseShowFilter(const string& param, ShowFilter& filter) {
+    enum Match {
+        MATCH_ISBN,
+        MATCH_EXACT,
+        MATCH_KEYWORD,
+        MATCH_PREFIX,
+        MATCH_CONTAINS,
+        MATCH_FUZZY
+    };
+    struct Option {
+        const char* option;
+        Match match;
+        ShowDependency dependency;
+        uint32_t field;
+    };
+    static const Option options[] = {
+        {"-ISBN=", MATCH_ISBN, DEP_CATALOG, 0},
+        {"-name=", MATCH_EXACT, DEP_NAME, GRAM_FIELD_NAME},
+        {"-author=", MATCH_EXACT, DEP_AUTHOR, GRAM_FIELD_AUTHOR},
+        {"-keyword=", MATCH_KEYWORD, DEP_KEYWORD, 0},
+        {"-name-prefix=", MATCH_PREFIX, DEP_GRAM, GRAM_FIELD_NAME},
+        {"-author-prefix=", MATCH_PREFIX, DEP_GRAM, GRAM_FIELD_AUTHOR},
+        {"-name-contains=", MATCH_CONTAINS, DEP_GRAM, GRAM_FIELD_NAME},
+        {"-author-contains=", MATCH_CONTAINS, DEP_GRAM, GRAM_FIELD_AUTHOR},
+        {"-name-fuzzy=", MATCH_FUZZY, DEP_GRAM, GRAM_FIELD_NAME},
+        {"-author-fuzzy=", MATCH_FUZZY, DEP_GRAM, GRAM_FIELD_AUTHOR},
+    };
+
+    const Option* option = nullptr;
+    for (const auto& o : options) {
+        if (param.compare(0, strlen(o.option), o.option) == 0) {
+            option = &o;
+            break;
+        }
+    }
+    if (option == nullptr) return false;
+    filter.option = option->option;
+    filter.dependency = option->dependency;
+
+    size_t len = strlen(option->option);
+    if (option->match == MATCH_ISBN) {
+        string isbn = param.substr(len);
+        if (isbn.empty() || !isValidISBN(isbn)) return false;
+        filter.postings.push_back(PostingList::ofIsbn(isbn));
+        return true;
+    }
+
+    if (param.length() < len + 3 || param[len] != '"' || param.back() != '"') return false;
+    string value = param.substr(len + 1, param.length() - len - 2);
+    if (option->match == MATCH_KEYWORD) {
+        if (value.empty() || value.find('|') != string::npos) return false;
+        filter.postings.push_back(PostingList::ofText(keywordIndex, value));
+        return true;
+    }
+    if (value.empty() || !isValidBookName(value)) return false;
+
+    if (option->match == MATCH_EXACT) {
+        auto& index = option->field == GRAM_FIELD_NAME ? nameIndex : authorIndex;
+        filter.postings.push_back(PostingList::ofText(index, value));
+        return true;
+    }
+
+    filter.field = option->field;
+    filter.value = value;
+    if (option->match == MATCH_FUZZY) {
+        filter.check = ShowFilter::CHECK_SIMILAR;
+        filter.grams = distinctGrams(anchoredGrams(filter.field, value));
+        size_t shared = (filter.grams.size() * FUZZY_SIMILARITY_PERCENT + 99) / 100;
+        filter.postings.push_back(PostingList::ofOverlap(filter.grams, shared));
+        return true;
+    }
+
+    bool prefix = option->match == MATCH_PREFIX;
+    filter.check = prefix ? ShowFilter::CHECK_PREFIX : ShowFilter::CHECK_CONTAINS;
+    vector<uint32_t> grams = distinctGrams(prefix ? anchoredGrams(filter.field, value)
+                                                  : plainGrams(filter.field, value));
+    for (uint32_t g : grams) {
+        filter.postings.push_back(PostingList::ofGram(g));
+    }
+    return true;
+}
+
+// Calls visit(book) for every book passing every filter, in ISBN order, as
+// the intersection produces it. Only books in all of the filters' posting
+// lists are read; the catalog is scanned only when no filter has a posting
+// list at all.
+template <class Visit>
+void selectBooks(const vector<ShowFilter>& filters, Visit visit) {
+    auto accept = [&](const Book& book) {
+        for (const auto& filter : filters) {
+            if (!filter.accepts(book)) return;
+        }
+        visit(book);
+    };
+
+    vector<PostingList> lists;
+    for (const auto& filter : filters) {
+        lists.insert(lists.end(), filter.postings.begin(), filter.postings.end());
+    }
+    if (lists.empty()) {
+        for (auto c = books.begin(); c.valid(); c.next()) {
+            accept(c.value());
+        }
         return;
     }
 
-    vector<Book> results;
+    intersectPostings(lists, [&](const string& isbn) {
+        Book book;
+        if (findBook(isbn, &book)) accept(book);
+    });
+}
+
+// Price part of a show query:
+//   -min-price=A -max-price=B   price within [A, B]
+//   -cheapest=N                 the N cheapest books in stock
+// Any of them puts the result in price order (ties in ISBN order).
+struct PriceQuery {
+    bool active = false;
+    double low = 0;
+    double high = HUGE_VAL;
+    long long limit = 0;  // 0: no limit, only in-stock books otherwise
+
+    bool accepts(const Book& book) const {
+        return book.price >= low && book.price <= high && (limit == 0 || book.quantity > 0);
+    }
+};
 
-    if (params.empty()) {
-        // Show all books
-        for (const auto& pair : books) {
-            results.push_back(pair.second);
+bool isPriceOption(const string& param) {
+    return param.compare(0, 11, "-min-price=") == 0 || param.compare(0, 11, "-max-price=") == 0 ||
+           param.compare(0, 10, "-cheapest=") == 0;
+}
+
+// Parses one price option into query. Returns false if it is malformed.
+bool parsePriceOption(const string& param, PriceQuery& query) {
+    string value = param.substr(param.find('=') + 1);
+    query.active = true;
+    if (param.compare(0, 10, "-cheapest=") == 0) {
+        if (!isValidQuantity(value)) return false;
+        query.limit = stoll(value);
+        return true;
+    }
+    if (!isValidPrice(value)) return false;
+    if (param.compare(0, 11, "-min-price=") == 0) {
+        query.low = stod(value);
+    } else {
+        query.high = stod(value);
+    }
+    return true;
+}
+
+// Entries of the price index inside the query's window, counting no
+// further than limit
+uint64_t countPriceWindow(const PriceQuery& query, uint64_t limit) {
+    uint64_t n = 0;
+    for (auto c = priceIndex.lowerBound(PriceKey(query.low, "")); c.valid() && n < limit; c.next()) {
+        if (c.key().price > query.high) break;
+        n++;
+    }
+    return n;
+}
+
+// True if walking the price window is cheaper than intersecting the
+// filters' postings. Both sides are counted in rounds with a growing limit,
+// as in planPostings, and the first to end decides; the intersection can
+// yield no more than its shortest list.
+bool priceWindowIsNarrower(const vector<ShowFilter>& filters, const PriceQuery& query) {
+    vector<PostingList> lists;
+    for (const auto& filter : filters) {
+        lists.insert(lists.end(), filter.postings.begin(), filter.postings.end());
+    }
+    for (uint64_t limit = 16;; limit *= 8) {
+        uint64_t window = countPriceWindow(query, limit);
+        uint64_t candidates = lists.empty() ? books.size() : limit;
+        for (const auto& list : lists) candidates = min(candidates, list.count(limit));
+        if (window < limit || candidates < limit) return window <= candidates;
+    }
+}
+
+// Calls visit(book) for every book passing every filter and the price
+// query, cheapest first. When the price window is the narrower side, the
+// price index is walked from the low bound and each entry is checked
+// against the filters; the walk stops at the high bound or the limit, so
+// without filters it costs O(log N + results) (plus any out-of-stock books
+// skipped for -cheapest). Otherwise the filters' matches are ranked by
+// (price, ISBN): a heap keeps only the cheapest N for -cheapest=N, and a
+// plain price range is sorted. Only the keys are held; the books are read
+// again as they are visited.
+template <class Visit>
+void selectBooksByPrice(const vector<ShowFilter>& filters, const PriceQuery& query, Visit visit) {
+    if (filters.empty() || priceWindowIsNarrower(filters, query)) {
+        long long found = 0;
+        for (auto c = priceIndex.lowerBound(PriceKey(query.low, "")); c.valid(); c.next()) {
+            if (c.key().price > query.high) break;
+            Book book;
+            if (!findBook(c.key().isbn, &book) || !query.accepts(book)) continue;
+            bool passes = true;
+            for (const auto& filter : filters) passes = passes && filter.matches(book);
+            if (!passes) continue;
+            visit(book);
+            if (++found == query.limit) break;
         }
-    } else if (params.size() == 1) {
-        string param = params[0];
-        if (param.substr(0, 6) == "-ISBN=") {
-            string isbn = param.substr(6);
-            if (isbn.empty() || !isValidISBN(isbn)) {
-                cout << "Invalid\n";
-                return;
-            }
-            if (books.find(isbn) != books.end()) {
-                results.push_back(books[isbn]);
-            }
-        } else if (param.substr(0, 6) == "-name=") {
-            if (param.length() < 9 || param[6] != '"' || param.back() != '"') {
-                cout << "Invalid\n";
-                return;
-            }
-            string name = param.substr(7, param.length() - 8);
-            if (name.empty() || !isValidBookName(name)) {
-                cout << "Invalid\n";
-                return;
-            }
-            for (const auto& pair : books) {
-                if (strcmp(pair.second.bookName, name.c_str()) == 0) {
-                    results.push_back(pair.second);
-                }
-            }
-        } else if (param.substr(0, 8) == "-author=") {
-            if (param.length() < 11 || param[8] != '"' || param.back() != '"') {
-                cout << "Invalid\n";
-                return;
-            }
-            string author = param.substr(9, param.length() - 10);
-            if (author.empty() || !isValidBookName(author)) {
-                cout << "Invalid\n";
-                return;
-            }
-            for (const auto& pair : books) {
-                if (strcmp(pair.second.author, author.c_str()) == 0) {
-                    results.push_back(pair.second);
-                }
-            }
-        } else if (param.substr(0, 9) == "-keyword=") {
-            if (param.length() < 12 || param[9] != '"' || param.back() != '"') {
-                cout << "Invalid\n";
-                return;
-            }
-            string keyword = param.substr(10, param.length() - 11);
-            if (keyword.empty()) {
-                cout << "Invalid\n";
-                return;
-            }
-            // Check if keyword contains '|'
-            if (keyword.find('|') != string::npos) {
-                cout << "Invalid\n";
-                return;
-            }
-            for (const auto& pair : books) {
-                string keywords = pair.second.keyword;
-                vector<string> kwList = split(keywords, '|');
-                for (const auto& kw : kwList) {
-                    if (kw == keyword) {
-                        results.push_back(pair.second);
-                        break;
-                    }
-                }
-            }
+        return;
+    }
+
+    auto cheaper = [](const PriceKey& a, const PriceKey& b) { return compareKey(a, b) < 0; };
+    vector<PriceKey> ranked;
+    selectBooks(filters, [&](const Book& book) {
+        if (!query.accepts(book)) return;
+        ranked.push_back(PriceKey(book.price, book.ISBN));
+        if (query.limit == 0) return;
+        push_heap(ranked.begin(), ranked.end(), cheaper);
+        if ((long long)ranked.size() > query.limit) {
+            pop_heap(ranked.begin(), ranked.end(), cheaper);
+            ranked.pop_back();
+        }
+    });
+    if (query.limit == 0) {
+        sort(ranked.begin(), ranked.end(), cheaper);
+    } else {
+        sort_heap(ranked.begin(), ranked.end(), cheaper);
+    }
+    for (const auto& key : ranked) {
+        Book book;
+        if (findBook(key.isbn, &book)) visit(book);
+    }
+}
+
+// One page of the catalog in ISBN order:
+//   -limit=N                 first N books
+//   -after=ISBN -limit=N     up to N books with ISBN strictly greater
+// Seeks straight into the ISBN tree, so a page costs O(log N + page size).
+// Returns false if the options are malformed.
+bool showPage(const vector<string>& params) {
+    string after;
+    string limit;
+    bool hasAfter = false;
+    for (const auto& param : params) {
+        if (param.substr(0, 7) == "-after=" && !hasAfter) {
+            after = param.substr(7);
+            hasAfter = true;
+        } else if (param.substr(0, 7) == "-limit=" && limit.empty()) {
+            limit = param.substr(7);
+            if (limit.empty()) return false;
         } else {
-            cout << "Invalid\n";
+            return false;
+        }
+    }
+    if (limit.empty() || !isValidQuantity(limit)) return false;
+    if (hasAfter && (after.empty() || !isValidISBN(after))) return false;
+
+    long long remaining = stoll(limit);
+    auto c = books.lowerBound(IsbnKey(after.c_str()));
+    if (hasAfter && c.valid() && strcmp(c.key().value, after.c_str()) == 0) c.next();
+
+    bool printed = false;
+    for (; c.valid() && remaining > 0; c.next(), remaining--) {
+        printBook(c.value());
+        printed = true;
+    }
+    if (!printed) cout << "\n";
+    return true;
+}
+
+// Prints the rows of a filtered show as they are produced and keeps a copy
+// for the show cache, given up as soon as it outgrows SHOW_CACHE_ENTRY_BYTES
+class ShowOutput {
+public:
+    void print(const Book& book) {
+        const string& row = bookRows.render(book);
+        cout.write(row.data(), row.size());
+        printed = true;
+        if (oversized) return;
+        if (output.size() + row.size() > SHOW_CACHE_ENTRY_BYTES) {
+            oversized = true;
+            string().swap(output);
+            ShowCache::RowVersions().swap(rows);
             return;
         }
-    } else {
+        output += row;
+        uint32_t slot = bookVersionSlot(book.ISBN);
+        rows.push_back({slot, bookVersions[slot].load(memory_order_acquire)});
+    }
+
+    // Ends the result (an empty one is a blank line) and caches it if it fit
+    void finish(const string& key, uint32_t dependencies, const IndexVersions& versions) {
+        if (!printed) {
+            cout << "\n";
+            output = "\n";
+        }
+        if (!oversized) showCache.store(key, dependencies, versions, move(rows), move(output));
+    }
+
+private:
+    string output;
+    ShowCache::RowVersions rows;
+    bool printed = false;
+    bool oversized = false;
+};
+
+// Cache key of a filtered show: the filters in a fixed order
+string showCacheKey(vector<string> params) {
+    sort(params.begin(), params.end());
+    string key;
+    for (const auto& param : params) {
+        key += param;
+        key += '\n';
+    }
+    return key;
+}
+
+void cmdShow(const vector<string>& params) {
+    if (getCurrentPrivilege() < 1) {
         cout << "Invalid\n";
         return;
     }
 
-    sort(results.begin(), results.end());
+    if (!params.empty() &&
+        (params[0].substr(0, 7) == "-after=" || params[0].substr(0, 7) == "-limit=")) {
+        if (!showPage(params)) cout << "Invalid\n";
+        return;
+    }
 
-    if (results.empty()) {
-        cout << "\n";
-    } else {
-        for (const auto& book : results) {
-            cout << book.ISBN << "\t" << book.bookName << "\t" << book.author << "\t"
-                 << book.keyword << "\t" << fixed << setprecision(2) << book.price << "\t"
-                 << book.quantity << "\n";
+    if (params.empty()) {
+        // Show all books, streamed in ISBN order
+        if (books.size() == 0) {
+            cout << "\n";
+            return;
+        }
+        for (auto c = books.begin(); c.valid(); c.next()) {
+            printBook(c.value());
+        }
+        return;
+    }
+
+    string cacheKey = showCacheKey(params);
+    if (showCache.serve(cacheKey, cout)) return;
+    IndexVersions versions = IndexVersions::current();
+    uint32_t dependencies = 0;
+
+    vector<ShowFilter> filters;
+    PriceQuery price;
+    set<string> options;
+    for (const auto& param : params) {
+        if (isPriceOption(param)) {
+            if (!parsePriceOption(param, price) ||
+                !options.insert(param.substr(0, param.find('=') + 1)).second) {
+                cout << "Invalid\n";
+                return;
+            }
+            dependencies |= 1u << DEP_PRICE;
+            if (price.limit > 0) dependencies |= 1u << DEP_STOCK;
+            continue;
         }
+        ShowFilter filter;
+        if (!parseShowFilter(param, filter) || !options.insert(filter.option).second) {
+            cout << "Invalid\n";
+            return;
+        }
+        dependencies |= 1u << filter.dependency;
+        filters.push_back(filter);
+    }
+    ShowOutput output;
+    if (price.active) {
+        selectBooksByPrice(filters, price, [&](const Book& book) { output.print(book); });
+    } else {
+        selectBooks(filters, [&](const Book& book) { output.print(book); });
     }
+    output.finish(cacheKey, dependencies, versions);
 }
 
 void cmdBuy(const vector<string>& params) {
@@ -569,29 +4701,12 @@ void cmdBuy(const vector<string>& params) {
 
     int quantity = stoi(quantityStr);
 
-    if (books.find(isbn) == books.end()) {
-        cout << "Invalid\n";
-        return;
-    }
-
-    Book& book = books[isbn];
-
-    if (book.quantity < quantity) {
+    double totalCost = 0;
+    if (!purchaseBook(isbn, quantity, totalCost)) {
         cout << "Invalid\n";
         return;
     }
 
-    double totalCost = book.price * quantity;
-    book.quantity -= quantity;
-
-    Transaction trans;
-    trans.amount = totalCost;
-    trans.isIncome = true;
-    transactions.push_back(trans);
-
-    saveBooks();
-    saveTransactions();
-
     cout << fixed << setprecision(2) << totalCost << "\n";
 }
 
@@ -613,12 +4728,12 @@ void cmdSelect(const vector<string>& params) {
         return;
     }
 
-    if (books.find(isbn) == books.end()) {
+    if (!findBook(isbn)) {
         // Create new book
         Book book;
         strcpy(book.ISBN, isbn.c_str());
-        books[isbn] = book;
-        saveBooks();
+        insertBook(book);
+        indexBook(book);
     }
 
     loginStack.back().selectedISBN = isbn;
@@ -641,7 +4756,9 @@ void cmdModify(const vector<string>& params) {
     }
 
     string selectedISBN = loginStack.back().selectedISBN;
-    Book book = books[selectedISBN];  // Make a copy instead of reference
+    Book book;
+    books.find(IsbnKey(selectedISBN.c_str()), &book);
+    Book original = book;
 
     set<string> usedParams;
     string newISBN = "";
@@ -668,7 +4785,7 @@ void cmdModify(const vector<string>& params) {
                 cout << "Invalid\n";
                 return;
             }
-            if (books.find(newISBN) != books.end()) {
+            if (findBook(newISBN)) {
                 cout << "Invalid\n";
                 return;
             }
@@ -739,16 +4856,17 @@ void cmdModify(const vector<string>& params) {
     }
 
     if (!newISBN.empty()) {
-        books.erase(selectedISBN);
+        eraseBook(selectedISBN);
         strcpy(book.ISBN, newISBN.c_str());
-        books[newISBN] = book;
-        loginStack.back().selectedISBN = newISBN;
+        insertBook(book);
+        followRenamedBook(selectedISBN, newISBN);
     } else {
         // Update the book in place if ISBN wasn't changed
-        books[selectedISBN] = book;
+        pinBook(book.ISBN);
+        books.update(IsbnKey(book.ISBN), book);
+        bumpBookVersion(book.ISBN);
     }
-
-    saveBooks();
+    reindexBook(original, book);
 }
 
 void cmdImport(const vector<string>& params) {
@@ -783,17 +4901,83 @@ void cmdImport(const vector<string>& params) {
         return;
     }
 
-    string selectedISBN = loginStack.back().selectedISBN;
-    Book& book = books[selectedISBN];
-    book.quantity += quantity;
+    restockBook(loginStack.back().selectedISBN, quantity, totalCost);
+}
 
-    Transaction trans;
-    trans.amount = totalCost;
-    trans.isIncome = false;
-    transactions.push_back(trans);
+// Accepts Unix seconds, YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS (UTC). A bare
+// date ends the day when endOfDay is set, so "-to=DATE" covers that day.
+bool parseTimestamp(const string& s, bool endOfDay, int64_t& result) {
+    if (s.empty()) return false;
+    if (s.find_first_not_of("0123456789") == string::npos) {
+        if (s.length() > 12) return false;
+        result = stoll(s);
+        return true;
+    }
+
+    tm t;
+    memset(&t, 0, sizeof(t));
+    int consumed = 0;
+    bool dateOnly = s.length() == 10;
+    if (dateOnly) {
+        if (sscanf(s.c_str(), "%4d-%2d-%2d%n", &t.tm_year, &t.tm_mon, &t.tm_mday, &consumed) != 3)
+            return false;
+    } else if (sscanf(s.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n", &t.tm_year, &t.tm_mon, &t.tm_mday,
+                      &t.tm_hour, &t.tm_min, &t.tm_sec, &consumed) != 6) {
+        return false;
+    }
+    if (consumed != (int)s.length() || t.tm_year < 1970 || t.tm_mon < 1 || t.tm_mon > 12 ||
+        t.tm_mday < 1 || t.tm_mday > 31 || t.tm_hour > 23 || t.tm_min > 59 || t.tm_sec > 59) {
+        return false;
+    }
+    t.tm_year -= 1900;
+    t.tm_mon -= 1;
+    // timegm normalizes out-of-range fields (Feb 30 becomes Mar 1, -1 hours
+    // the previous day); a date that does not survive unchanged is invalid
+    tm given = t;
+    result = timegm(&t);
+    if (t.tm_year != given.tm_year || t.tm_mon != given.tm_mon || t.tm_mday != given.tm_mday ||
+        t.tm_hour != given.tm_hour || t.tm_min != given.tm_min || t.tm_sec != given.tm_sec) {
+        return false;
+    }
+    if (dateOnly && endOfDay) result += 24 * 60 * 60 - 1;
+    return true;
+}
+
+// show finance -from=T1 -to=T2: income and expenditure stamped in [T1, T2];
+// either end may be left open
+void showFinanceBetween(const vector<string>& params) {
+    int64_t from = 0;
+    int64_t to = INT64_MAX;
+    bool hasFrom = false, hasTo = false;
+    for (const auto& param : params) {
+        if (param.substr(0, 6) == "-from=" && !hasFrom) {
+            if (!parseTimestamp(param.substr(6), false, from)) {
+                cout << "Invalid\n";
+                return;
+            }
+            hasFrom = true;
+        } else if (param.substr(0, 4) == "-to=" && !hasTo) {
+            if (!parseTimestamp(param.substr(4), true, to)) {
+                cout << "Invalid\n";
+                return;
+            }
+            hasTo = true;
+        } else {
+            cout << "Invalid\n";
+            return;
+        }
+    }
+    if (from > to) {
+        cout << "Invalid\n";
+        return;
+    }
 
-    saveBooks();
-    saveTransactions();
+    CentSum income = 0;
+    CentSum expenditure = 0;
+    transactions.sumBetween(from, to, income, expenditure);
+
+    cout << "+ " << fixed << setprecision(2) << income / 100.0 << " - " << expenditure / 100.0
+         << "\n";
 }
 
 void cmdShowFinance(const vector<string>& params) {
@@ -802,6 +4986,11 @@ void cmdShowFinance(const vector<string>& params) {
         return;
     }
 
+    if (!params.empty() && (params[0].substr(0, 6) == "-from=" || params[0].substr(0, 4) == "-to=")) {
+        showFinanceBetween(params);
+        return;
+    }
+
     if (params.size() > 1) {
         cout << "Invalid\n";
         return;
@@ -841,19 +5030,12 @@ void cmdShowFinance(const vector<string>& params) {
         }
     }
 
-    double income = 0.0;
-    double expenditure = 0.0;
-
-    int start = transactions.size() - count;
-    for (int i = start; i < (int)transactions.size(); i++) {
-        if (transactions[i].isIncome) {
-            income += transactions[i].amount;
-        } else {
-            expenditure += transactions[i].amount;
-        }
-    }
+    CentSum income = 0;
+    CentSum expenditure = 0;
+    transactions.sumLast(count, income, expenditure);
 
-    cout << "+ " << fixed << setprecision(2) << income << " - " << expenditure << "\n";
+    cout << "+ " << fixed << setprecision(2) << income / 100.0 << " - " << expenditure / 100.0
+         << "\n";
 }
 
 void cmdLog() {
@@ -873,37 +5055,702 @@ void cmdReportFinance() {
     }
 
     cout << "=== Financial Report ===\n";
-    double income = 0.0;
-    double expenditure = 0.0;
+    CentSum income = 0;
+    CentSum expenditure = 0;
+    transactions.totals(income, expenditure);
 
-    for (const auto& trans : transactions) {
-        if (trans.isIncome) {
-            income += trans.amount;
+    cout << "Total Income: " << fixed << setprecision(2) << income / 100.0 << "\n";
+    cout << "Total Expenditure: " << expenditure / 100.0 << "\n";
+    cout << "Net Profit: " << (income - expenditure) / 100.0 << "\n";
+}
+
+void cmdReportEmployee() {
+    if (getCurrentPrivilege() < 7) {
+        cout << "Invalid\n";
+        return;
+    }
+
+    cout << "=== Employee Work Report ===\n";
+    cout << "Total employees: " << accounts.size() << "\n";
+}
+
+void cmdReportStorage() {
+    if (getCurrentPrivilege() < 7) {
+        cout << "Invalid\n";
+        return;
+    }
+
+    PoolStats stats = bufferPool.statistics();
+    uint64_t lookups = stats.hits + stats.misses;
+    double hitRate = lookups == 0 ? 0.0 : 100.0 * stats.hits / lookups;
+
+    cout << "=== Storage Report ===\n";
+    cout << "Buffer pool: " << bufferPool.frameTotal() << " pages (" << bufferPool.capacity()
+         << " bytes, " << bufferPool.partitionTotal() << " partitions)\n";
+    cout << "Hits: " << stats.hits << "  Misses: " << stats.misses << "  Hit rate: " << fixed
+         << setprecision(2) << hitRate << "%\n";
+    cout << "Evictions: " << stats.evictions << "  Write-backs: " << stats.writebacks << "\n";
+
+    const IoStats& io = storageIo.statistics();
+    cout << "I/O backend: " << storageIo.backendName() << "  Page writes: " << io.writes
+         << "  Coalesced: " << io.coalesced << "  Submissions: " << io.submissions
+         << "  Fsyncs: " << io.fsyncs << "  Stalls: " << io.stalls << "\n";
+
+    for (const auto& tree : storageTrees()) {
+        TreeFragmentation frag = tree.second->fragmentation();
+        cout << tree.first << ": " << frag.pages << " pages, " << frag.leaves << " leaves "
+             << setprecision(1) << 100.0 * frag.fill << "% full, " << frag.freePages
+             << " free pages, " << frag.outOfOrder << " out-of-order leaf links\n";
+    }
+    cout << "Compaction: " << compactionStats.idleRounds << " idle rounds, "
+         << compactionStats.budgetRounds << " rounds every " << COMPACTION_INTERVAL
+         << " commands\n";
+    const pair<string, BloomFilter*> filters[] = {
+        {ISBN_FILTER_FILE, &isbnFilter},
+        {USER_FILTER_FILE, &userFilter},
+    };
+    for (const auto& filter : filters) {
+        BloomStats bloom = filter.second->statistics();
+        cout << filter.first << ": " << filter.second->pageCount() << " pages, "
+             << filter.second->keys() << " keys, " << bloom.lookups << " lookups, "
+             << bloom.negatives << " rejected, " << bloom.falsePositives << " false positives\n";
+    }
+    const pair<string, PagedStructure*> files[] = {
+        {TRANSACTION_FILE, &transactions},
+        {SEGMENT_INDEX_FILE, &transactions.segmentIndex()},
+    };
+    for (const auto& file : files) {
+        cout << file.first << ": " << file.second->pageCount() << " pages\n";
+    }
+
+    const ShowCacheStats& cache = showCache.statistics();
+    cout << "Show cache: " << showCache.size() << " entries, " << showCache.memory()
+         << " bytes, " << cache.hits << " hits, " << cache.misses << " misses, " << cache.stale
+         << " stale\n";
+
+    uint64_t sealed = transactions.size() - transactions.size() % SEGMENT_SIZE;
+    cout << "Transaction segments: " << transactions.segmentCount() << " ("
+         << transactions.encodedBytes() << " bytes";
+    if (sealed > 0) {
+        cout << ", " << setprecision(2) << (double)transactions.encodedBytes() / sealed
+             << " bytes per transaction";
+    }
+    cout << ")\n";
+}
+
+// ==================== Export ====================
+//
+// export <books|accounts|transactions> <csv|columnar> <path> streams one
+// store to a file. Records are read in storage order (leaf chains and
+// ledger segments) and written through a fixed output buffer, so memory
+// stays constant whatever the store size. Account passwords are never
+// exported; amounts are written as exact integer cents.
+//
+// The command only starts the export. It then advances EXPORT_STEP_ROWS
+// rows after every command and continuously while the input is idle, so
+// the store keeps serving meanwhile. The file holds the store as it was
+// when the export started: trees are walked by key with rows changed ahead
+// of the cursor pinned (SnapshotPins), and the ledger, being append-only,
+// is cut at its length at the start. The rows go to <path>.part, which is
+// renamed to <path> once complete. A second export, or the end of input,
+// first finishes the one in progress.
+//
+// Columnar layout: "BKCOL1\0\0", uint32 column count, then per column
+// char name[16], uint8 type, uint8 scale (decimal places), uint16 width;
+// then blocks of uint32 row count followed by each column's values laid
+// out contiguously (text NUL-padded to width, numbers as int64); a zero
+// row count ends the file.
+
+const size_t EXPORT_BUFFER_BYTES = 1 << 20;
+const uint32_t EXPORT_BLOCK_ROWS = 4096;
+const size_t EXPORT_STEP_ROWS = 4096;
+const string EXPORT_PART_SUFFIX = ".part";
+
+enum ColumnType : uint8_t {
+    COLUMN_TEXT = 1,
+    COLUMN_NUMBER = 2
+};
+
+struct ColumnSpec {
+    const char* name;
+    ColumnType type;
+    uint8_t scale;
+    uint16_t width;
+};
+
+// Write-only file with a large fixed buffer
+class ExportFile {
+public:
+    ExportFile() : fd(-1), used(0), buffer(EXPORT_BUFFER_BYTES) {}
+    ~ExportFile() { close(); }
+
+    bool open(const string& path) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        return fd >= 0;
+    }
+
+    void write(const char* data, size_t length) {
+        while (length > 0) {
+            if (used == buffer.size()) flush();
+            size_t chunk = min(length, buffer.size() - used);
+            memcpy(&buffer[used], data, chunk);
+            used += chunk;
+            data += chunk;
+            length -= chunk;
+        }
+    }
+
+    void close() {
+        if (fd < 0) return;
+        flush();
+        ::close(fd);
+        fd = -1;
+    }
+
+private:
+    int fd;
+    size_t used;
+    vector<char> buffer;
+
+    void flush() {
+        for (size_t done = 0; done < used;) {
+            ssize_t n = ::write(fd, &buffer[done], used - done);
+            if (n <= 0) throw runtime_error("export: write failed");
+            done += n;
+        }
+        used = 0;
+    }
+};
+
+// Receives rows column by column, in the order of the schema
+class ExportSink {
+public:
+    virtual ~ExportSink() {}
+    virtual void text(const char* value) = 0;
+    virtual void number(int64_t value) = 0;
+    virtual void endRow() = 0;
+    virtual void finish() = 0;
+};
+
+class CsvSink : public ExportSink {
+public:
+    CsvSink(ExportFile& out, const vector<ColumnSpec>& columns) : out(out), columns(columns), column(0) {
+        for (size_t i = 0; i < columns.size(); i++) {
+            if (i > 0) out.write(",", 1);
+            out.write(columns[i].name, strlen(columns[i].name));
+        }
+        out.write("\n", 1);
+    }
+
+    // Quoted per RFC 4180 when needed: ISBNs and usernames may contain
+    // double quotes, which are doubled inside the quotes
+    void text(const char* value) override {
+        separate();
+        if (strpbrk(value, "\",\r\n") == nullptr) {
+            out.write(value, strlen(value));
+            return;
+        }
+        out.write("\"", 1);
+        for (const char* quote; (quote = strchr(value, '"')) != nullptr; value = quote + 1) {
+            out.write(value, quote + 1 - value);
+            out.write("\"", 1);
+        }
+        out.write(value, strlen(value));
+        out.write("\"", 1);
+    }
+
+    void number(int64_t value) override {
+        separate();
+        char digits[32];
+        int scale = columns[column - 1].scale;
+        int length;
+        if (scale == 0) {
+            length = snprintf(digits, sizeof(digits), "%lld", (long long)value);
         } else {
-            expenditure += trans.amount;
+            int64_t unit = 1;
+            for (int i = 0; i < scale; i++) unit *= 10;
+            uint64_t magnitude = value < 0 ? -(uint64_t)value : value;
+            length = snprintf(digits, sizeof(digits), "%s%llu.%0*llu", value < 0 ? "-" : "",
+                              (unsigned long long)(magnitude / unit), scale,
+                              (unsigned long long)(magnitude % unit));
+        }
+        out.write(digits, length);
+    }
+
+    void endRow() override {
+        out.write("\n", 1);
+        column = 0;
+    }
+
+    void finish() override {}
+
+private:
+    ExportFile& out;
+    vector<ColumnSpec> columns;
+    size_t column;
+
+    void separate() {
+        if (column++ > 0) out.write(",", 1);
+    }
+};
+
+class ColumnarSink : public ExportSink {
+public:
+    ColumnarSink(ExportFile& out, const vector<ColumnSpec>& columns)
+        : out(out), columns(columns), blocks(columns.size()), column(0), rows(0) {
+        out.write("BKCOL1\0\0", 8);
+        uint32_t count = columns.size();
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (size_t i = 0; i < columns.size(); i++) {
+            char name[16] = {};
+            copyField(name, sizeof(name), columns[i].name);
+            out.write(name, sizeof(name));
+            out.write(reinterpret_cast<const char*>(&columns[i].type), 1);
+            out.write(reinterpret_cast<const char*>(&columns[i].scale), 1);
+            out.write(reinterpret_cast<const char*>(&columns[i].width), 2);
+            blocks[i].resize((size_t)EXPORT_BLOCK_ROWS * columns[i].width);
+        }
+    }
+
+    void text(const char* value) override {
+        char* cell = nextCell();
+        size_t width = columns[column - 1].width;
+        memset(cell, 0, width);
+        memcpy(cell, value, strnlen(value, width));
+    }
+
+    void number(int64_t value) override { memcpy(nextCell(), &value, sizeof(value)); }
+
+    void endRow() override {
+        column = 0;
+        if (++rows == EXPORT_BLOCK_ROWS) flushBlock();
+    }
+
+    void finish() override {
+        flushBlock();
+        uint32_t end = 0;
+        out.write(reinterpret_cast<const char*>(&end), sizeof(end));
+    }
+
+private:
+    ExportFile& out;
+    vector<ColumnSpec> columns;
+    vector<vector<char>> blocks;
+    size_t column;
+    uint32_t rows;
+
+    char* nextCell() {
+        size_t i = column++;
+        return &blocks[i][(size_t)rows * columns[i].width];
+    }
+
+    void flushBlock() {
+        if (rows == 0) return;
+        out.write(reinterpret_cast<const char*>(&rows), sizeof(rows));
+        for (size_t i = 0; i < columns.size(); i++) {
+            out.write(blocks[i].data(), (size_t)rows * columns[i].width);
         }
+        rows = 0;
     }
+};
+
+const vector<ColumnSpec> BOOK_COLUMNS = {
+    {"isbn", COLUMN_TEXT, 0, 20},        {"name", COLUMN_TEXT, 0, 60},
+    {"author", COLUMN_TEXT, 0, 60},      {"keyword", COLUMN_TEXT, 0, 60},
+    {"price", COLUMN_NUMBER, 2, 8},      {"quantity", COLUMN_NUMBER, 0, 8},
+};
+const vector<ColumnSpec> ACCOUNT_COLUMNS = {
+    {"user_id", COLUMN_TEXT, 0, 30},
+    {"username", COLUMN_TEXT, 0, 30},
+    {"privilege", COLUMN_NUMBER, 0, 8},
+};
+const vector<ColumnSpec> TRANSACTION_COLUMNS = {
+    {"seq", COLUMN_NUMBER, 0, 8},
+    {"timestamp", COLUMN_NUMBER, 0, 8},
+    {"income", COLUMN_NUMBER, 0, 8},
+    {"amount", COLUMN_NUMBER, 2, 8},
+};
 
-    cout << "Total Income: " << fixed << setprecision(2) << income << "\n";
-    cout << "Total Expenditure: " << expenditure << "\n";
-    cout << "Net Profit: " << (income - expenditure) << "\n";
+// Writes up to budget rows of a tree past pins.cursor in key order,
+// taking pinned rows in place of live ones. Returns false once the tree is
+// exhausted.
+template <class Key, class Tree, class Value, class Write>
+bool exportTreeStep(Tree& tree, SnapshotPins<Value>& pins, size_t budget, Write write) {
+    auto c = tree.lowerBound(Key(pins.cursor.c_str()));
+    if (c.valid() && pins.cursor == c.key().value) c.next();
+    auto pin = pins.pins.upper_bound(pins.cursor);
+    for (size_t n = 0; n < budget; n++) {
+        bool live = c.valid();
+        bool pinned = pin != pins.pins.end();
+        if (!live && !pinned) return false;
+        int order = !live ? 1 : !pinned ? -1 : strcmp(c.key().value, pin->first.c_str());
+        if (order < 0) {
+            write(c.value());
+            pins.cursor = c.key().value;
+            c.next();
+            continue;
+        }
+        if (pin->second.present) write(pin->second.value);
+        pins.cursor = pin->first;
+        if (order == 0) c.next();
+        pin = pins.pins.erase(pin);
+    }
+    return true;
 }
 
-void cmdReportEmployee() {
+// One export in progress
+class ExportJob {
+public:
+    enum Table { BOOKS, ACCOUNTS, TRANSACTIONS };
+
+    ExportJob(Table table, const string& path) : table(table), path(path), next(0), end(0) {}
+
+    bool open(bool csv) {
+        const vector<ColumnSpec>& columns = table == BOOKS      ? BOOK_COLUMNS
+                                            : table == ACCOUNTS ? ACCOUNT_COLUMNS
+                                                                : TRANSACTION_COLUMNS;
+        if (!out.open(path + EXPORT_PART_SUFFIX)) return false;
+        if (csv) {
+            sink.reset(new CsvSink(out, columns));
+        } else {
+            sink.reset(new ColumnarSink(out, columns));
+        }
+        if (table == BOOKS) {
+            bookPins.start();
+            books.adviseSequential(true);
+        } else if (table == ACCOUNTS) {
+            accountPins.start();
+            accounts.adviseSequential(true);
+        } else {
+            end = transactions.size();
+            transactions.adviseSequential(true);
+        }
+        return true;
+    }
+
+    // Writes up to budget rows; returns false once the file is complete
+    bool step(size_t budget) {
+        bool more;
+        if (table == BOOKS) {
+            more = exportTreeStep<IsbnKey>(books, bookPins, budget, [&](const Book& book) {
+                sink->text(book.ISBN);
+                sink->text(book.bookName);
+                sink->text(book.author);
+                sink->text(book.keyword);
+                sink->number(toCents(book.price));
+                sink->number(book.quantity);
+                sink->endRow();
+            });
+        } else if (table == ACCOUNTS) {
+            more = exportTreeStep<UserKey>(accounts, accountPins, budget, [&](const Account& account) {
+                sink->text(account.userID);
+                sink->text(account.username);
+                sink->number(account.privilege);
+                sink->endRow();
+            });
+        } else {
+            uint64_t last = min<uint64_t>(end, next + budget);
+            transactions.forRange(next, last, [&](const LedgerEntry& entry) {
+                sink->number(++next);
+                sink->number(entry.time);
+                sink->number(entry.isIncome);
+                sink->number(entry.cents);
+                sink->endRow();
+            });
+            more = next < end;
+        }
+        if (!more) finish();
+        return more;
+    }
+
+private:
+    Table table;
+    string path;
+    ExportFile out;
+    unique_ptr<ExportSink> sink;
+    uint64_t next;  // transactions written
+    uint64_t end;   // ledger length at the start
+
+    void finish() {
+        sink->finish();
+        out.close();
+        if (rename((path + EXPORT_PART_SUFFIX).c_str(), path.c_str()) != 0) {
+            throw runtime_error("export: cannot rename " + path + EXPORT_PART_SUFFIX);
+        }
+        if (table == BOOKS) {
+            bookPins.stop();
+            books.adviseSequential(false);
+        } else if (table == ACCOUNTS) {
+            accountPins.stop();
+            accounts.adviseSequential(false);
+        } else {
+            transactions.adviseSequential(false);
+        }
+    }
+};
+
+unique_ptr<ExportJob> exportJob;
+
+// Advances the export in progress by up to budget rows; returns true while
+// it has more to write
+bool advanceExport(size_t budget) {
+    if (!exportJob) return false;
+    if (exportJob->step(budget)) return true;
+    exportJob.reset();
+    return false;
+}
+
+void finishExport() {
+    while (advanceExport(EXPORT_STEP_ROWS)) {
+    }
+}
+
+void cmdExport(const vector<string>& params) {
     if (getCurrentPrivilege() < 7) {
         cout << "Invalid\n";
         return;
     }
 
-    cout << "=== Employee Work Report ===\n";
-    cout << "Total employees: " << accounts.size() << "\n";
+    if (params.size() != 3 || (params[1] != "csv" && params[1] != "columnar")) {
+        cout << "Invalid\n";
+        return;
+    }
+    const string& what = params[0];
+    const string& path = params[2];
+    if ((what != "books" && what != "accounts" && what != "transactions") || isStoreFile(path) ||
+        isStoreFile(path + EXPORT_PART_SUFFIX)) {
+        cout << "Invalid\n";
+        return;
+    }
+
+    finishExport();
+    ExportJob::Table table = what == "books"      ? ExportJob::BOOKS
+                             : what == "accounts" ? ExportJob::ACCOUNTS
+                                                  : ExportJob::TRANSACTIONS;
+    unique_ptr<ExportJob> job(new ExportJob(table, path));
+    if (!job->open(params[1] == "csv")) {
+        cout << "Invalid\n";
+        return;
+    }
+    exportJob = move(job);
+}
+
+// True if the next command is already buffered or waiting on stdin. A
+// regular file always polls readable, so batch input never looks idle;
+// compactOnBudget covers that case.
+bool inputPending() {
+    if (cin.rdbuf()->in_avail() > 0) return true;
+    pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&fd, 1, 0) != 0;
+}
+
+// Once input runs dry, hardens the journal before the answers so far are
+// flushed, then advances the export in progress and runs bounded compaction
+// steps over all trees until input arrives or nothing is left to do; each
+// round is checkpointed on its own
+void compactWhileIdle() {
+    if (inputPending()) return;
+    pageJournal.flush();
+    cout.flush();
+    storageIo.poll();
+    bool working = true;
+    while (working && !inputPending()) {
+        working = advanceExport(EXPORT_STEP_ROWS);
+        if (compactRound()) working = true;
+        compactionStats.idleRounds++;
+        bufferPool.checkpoint();
+    }
+}
+
+// ==================== Bulk loading ====================
+//
+// code --bulk-load books.tsv seeds the catalog offline. Rows are sorted
+// externally within the buffer pool budget, then the ISBN tree and every
+// secondary index are written bottom-up in one sequential pass each.
+
+// Parses one dump row: ISBN, name, author, keyword, price, quantity separated
+// by tabs (the layout `show` prints). Trailing fields may be omitted.
+bool parseBookRow(const string& line, Book& book) {
+    vector<string> fields = split(line, '\t');
+    if (fields.empty() || fields.size() > 6) return false;
+    fields.resize(6);
+    if (!isValidISBN(fields[0])) return false;
+    if (!fields[1].empty() && !isValidBookName(fields[1])) return false;
+    if (!fields[2].empty() && !isValidBookName(fields[2])) return false;
+    if (!fields[3].empty() && !isValidKeyword(fields[3])) return false;
+    if (!fields[4].empty() && !isValidPrice(fields[4])) return false;
+    if (!fields[5].empty() && fields[5] != "0" && !isValidQuantity(fields[5])) return false;
+
+    strcpy(book.ISBN, fields[0].c_str());
+    strcpy(book.bookName, fields[1].c_str());
+    strcpy(book.author, fields[2].c_str());
+    strcpy(book.keyword, fields[3].c_str());
+    book.price = fields[4].empty() ? 0.0 : stod(fields[4]);
+    book.quantity = fields[5].empty() ? 0 : stoi(fields[5]);
+    return true;
+}
+
+// Loads a dump into the catalog and rebuilds every book structure. Books
+// already in the store are kept and win over rows with the same ISBN, as
+// does the first of several such rows. Returns the process exit code.
+int bulkLoad(const string& path) {
+    ifstream in(path);
+    if (!in) {
+        cerr << "bulk load: cannot open " << path << "\n";
+        return 1;
+    }
+    initialize();
+
+    size_t budget = bufferPool.capacity();
+    auto isbnLess = [](const Book& a, const Book& b) { return strcmp(a.ISBN, b.ISBN) < 0; };
+    SpillFile spill(SPILL_FILE);
+    ExternalSorter<Book, decltype(isbnLess)> rows(spill, budget, isbnLess);
+    uint64_t existing = books.size();
+    for (auto c = books.begin(); c.valid(); c.next()) rows.add(c.value());
+
+    uint64_t rejected = 0;
+    string line;
+    while (getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        Book book;
+        if (parseBookRow(line, book)) {
+            rows.add(book);
+        } else {
+            rejected++;
+        }
+    }
+
+    IndexBuild indexes(spill, budget);
+
+    uint64_t loaded = 0;
+    uint64_t duplicates = 0;
+    {
+        vector<unique_ptr<Catalog::Shard::Builder>> builders;
+        for (int i = 0; i < CATALOG_SHARDS; i++) {
+            builders.emplace_back(new Catalog::Shard::Builder(&books.shard(i)));
+        }
+        Book previous;
+        rows.merge([&](const Book& book) {
+            if (loaded > 0 && strcmp(previous.ISBN, book.ISBN) == 0) {
+                duplicates++;
+                return;
+            }
+            builders[Catalog::shardOf(book.ISBN)]->append(IsbnKey(book.ISBN), book);
+            indexes.add(book);
+            previous = book;
+            loaded++;
+        });
+        for (auto& builder : builders) builder->finish();
+    }
+
+    indexes.finish();
+    rebuildFilter(isbnFilter, books);
+    shutdown();
+
+    cout << "Loaded " << loaded - existing << " books, catalog now holds " << loaded << " ("
+         << duplicates << " duplicates, " << rejected << " rejected rows)\n";
+    return 0;
 }
 
-int main() {
+#ifdef BOOKSTORE_BENCH
+// ==================== Benchmark ====================
+//
+// bench [books] [operations per thread]: seeds a scratch store, then runs
+// 1, 2, 4 and 8 threads that each alternate buy and import on random books
+// and reports throughput. Built as a separate target with BOOKSTORE_BENCH.
+
+int main(int argc, char* argv[]) {
+    int bookCount = argc > 1 ? atoi(argv[1]) : 10000;
+    int operations = argc > 2 ? atoi(argv[2]) : 100000;
+    if (bookCount <= 0 || operations <= 0) {
+        cerr << "usage: " << argv[0] << " [books] [operations per thread]\n";
+        return 1;
+    }
+
+    char dir[] = "/tmp/bookstore-bench-XXXXXX";
+    if (mkdtemp(dir) == nullptr || chdir(dir) != 0) {
+        cerr << "bench: cannot create scratch directory\n";
+        return 1;
+    }
+    initialize();
+
+    const int initialQuantity = 1000000000;
+    vector<string> isbns;
+    for (int i = 0; i < bookCount; i++) {
+        Book book;
+        snprintf(book.ISBN, sizeof(book.ISBN), "978%09d", i);
+        book.price = 10.0;
+        book.quantity = initialQuantity;
+        insertBook(book);
+        isbns.push_back(book.ISBN);
+    }
+
+    cout << "books=" << bookCount << " shards=" << CATALOG_SHARDS
+         << " pool partitions=" << bufferPool.partitionTotal()
+         << " hardware threads=" << thread::hardware_concurrency() << "\n";
+    double baseline = 0;
+    int64_t netSold = 0;
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        vector<int64_t> sold(threads, 0);
+        auto start = chrono::steady_clock::now();
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                mt19937 rng(t + 1);
+                double cost;
+                for (int i = 0; i < operations; i++) {
+                    const string& isbn = isbns[rng() % isbns.size()];
+                    if (i % 2 == 0) {
+                        if (purchaseBook(isbn, 1, cost)) sold[t]++;
+                    } else if (restockBook(isbn, 1, 5.0)) {
+                        sold[t]--;
+                    }
+                }
+            });
+        }
+        for (auto& worker : workers) worker.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double rate = (double)threads * operations / seconds;
+        if (threads == 1) baseline = rate;
+        for (int64_t s : sold) netSold += s;
+        cout << "threads=" << threads << " ops=" << (int64_t)threads * operations << " time="
+             << fixed << setprecision(3) << seconds << "s throughput=" << setprecision(0) << rate
+             << " ops/s speedup=" << setprecision(2) << rate / baseline << "\n";
+    }
+
+    // Every buy and import must have landed exactly once
+    int64_t stock = 0;
+    for (auto c = books.begin(); c.valid(); c.next()) stock += c.value().quantity;
+    bool consistent = stock == (int64_t)bookCount * initialQuantity - netSold;
+    cout << "transactions=" << transactions.size() << " stock "
+         << (consistent ? "consistent" : "INCONSISTENT") << "\n";
+
+    shutdown();
+    DIR* scratch = opendir(".");
+    while (dirent* entry = readdir(scratch)) {
+        if (entry->d_name[0] != '.') unlink(entry->d_name);
+    }
+    closedir(scratch);
+    rmdir(dir);
+    return consistent ? 0 : 1;
+}
+#else
+// Errors from the storage layer (an unreadable store, failed I/O) end the
+// process with a message rather than an abort
+int main(int argc, char* argv[]) try {
+    ios::sync_with_stdio(false);
+    if (argc == 3 && strcmp(argv[1], "--bulk-load") == 0) return bulkLoad(argv[2]);
+    if (argc != 1) {
+        cerr << "usage: " << argv[0] << " [--bulk-load books.tsv]\n";
+        return 1;
+    }
     initialize();
 
     string line;
-    while (getline(cin, line)) {
+    while (true) {
+        compactWhileIdle();
+        if (!getline(cin, line)) break;
         trim(line);
 
         if (line.empty()) {
@@ -972,12 +5819,16 @@ int main() {
             cmdImport(params);
         } else if (cmd == "log") {
             cmdLog();
+        } else if (cmd == "export") {
+            cmdExport(params);
         } else if (cmd == "report") {
             if (params.size() == 1) {
                 if (params[0] == "finance") {
                     cmdReportFinance();
                 } else if (params[0] == "employee") {
                     cmdReportEmployee();
+                } else if (params[0] == "storage") {
+                    cmdReportStorage();
                 } else {
                     cout << "Invalid\n";
                 }
@@ -987,8 +5838,17 @@ int main() {
         } else {
             cout << "Invalid\n";
         }
+        advanceExport(EXPORT_STEP_ROWS);
+        compactOnBudget();
+        bufferPool.checkpoint();
     }
 
+    finishExport();
+    shutdown();
     return 0;
+} catch (const exception& e) {
+    cout.flush();
+    cerr << "error: " << e.what() << "\n";
+    return 1;
 }
-
+#endif